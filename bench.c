@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static pid_t  shell_pid = -1;
+static double started;
+
+double bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_die(const char *what) {
+    fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+// Starts the shell, with arg unless NULL, its stdin on a pipe and its
+// stdout on /dev/null. fd3, unless -1, becomes the shell's descriptor 3.
+// Returns the stream the script goes to
+FILE *bench_start(const char *shell, const char *arg, int fd3) {
+    int fd[2], null;
+    FILE *script;
+
+    if (pipe2(fd, O_CLOEXEC) == -1)
+        bench_die("pipe");
+    signal(SIGPIPE, SIG_IGN);
+
+    started = bench_now();
+    if ((shell_pid = fork()) == 0) {
+        if ((null = open("/dev/null", O_WRONLY)) == -1)
+            _exit(127);
+        dup2(fd[0], STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        if (fd3 >= 0)
+            dup2(fd3, 3);
+        execl(shell, shell, arg, (char *) NULL);
+        _exit(127);
+    }
+    if (shell_pid == -1)
+        bench_die("fork");
+    close(fd[0]);
+
+    if (!(script = fdopen(fd[1], "w")))
+        bench_die("fdopen");
+    setvbuf(script, NULL, _IOFBF, 1 << 16);
+    return script;
+}
+
+// Ends the script and waits for the shell. The read count is taken
+// while the shell is still a zombie
+void bench_finish(FILE *script, struct bench_run *run) {
+    char path[64], line[128];
+    siginfo_t info;
+    FILE *io;
+
+    fclose(script);
+    while (waitid(P_PID, shell_pid, &info, WEXITED | WNOWAIT) == -1) {
+        if (errno != EINTR)
+            bench_die("waitid");
+    }
+    run->seconds = bench_now() - started;
+
+    run->read_calls = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int) shell_pid);
+    if ((io = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), io)) {
+            if (!strncmp(line, "syscr:", 6))
+                run->read_calls = strtoull(line + 6, NULL, 10);
+        }
+        fclose(io);
+    }
+
+    waitpid(shell_pid, &run->status, 0);
+    shell_pid = -1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+void bench_sort(double *v, int n) {
+    qsort(v, n, sizeof(double), compare_doubles);
+}
+
+// Nearest rank percentile of n sorted values
+double bench_percentile(const double *v, int n, double p) {
+    int rank = (int) (p * n);
+
+    if (rank < p * n)
+        rank++;
+    return v[rank > 0 ? rank - 1 : 0];
+}
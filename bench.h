@@ -0,0 +1,25 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+    #include <stdio.h>
+    #include <stdint.h>
+
+    // Helpers shared by the bench_* programs. Each one times the shell on
+    // a script it generates, written down a pipe so nothing large has to
+    // land on disk
+    #define BENCH_SHELL "./shell"
+
+    struct bench_run {
+        double   seconds;
+        uint64_t read_calls;   // read(2) and the like, from /proc/<pid>/io
+        int      status;
+    };
+
+    double bench_now();
+    FILE  *bench_start(const char *, const char *, int);
+    void   bench_finish(FILE *, struct bench_run *);
+    void   bench_sort(double *, int);
+    double bench_percentile(const double *, int, double);
+    void   bench_die(const char *);
+
+#endif
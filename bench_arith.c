@@ -0,0 +1,63 @@
+// Counter loop with $(( )) against the same loop forking expr. The shell
+// has no loop construct, so the loop is unrolled into count lines:
+//
+//     bench_arith [-s shell] [-n count] [-e expr_count]
+//
+// expr costs a fork per iteration, it runs expr_count iterations and its
+// total is scaled to count
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define DEFAULT_COUNT      100000
+#define DEFAULT_EXPR_COUNT 10000
+
+static double run_loop(const char *shell, const char *line, long count) {
+    struct bench_run run;
+    FILE *script;
+    long i;
+
+    script = bench_start(shell, NULL, -1);
+    fputs("i=0\n", script);
+    for (i = 0; i < count; i++)
+        fputs(line, script);
+    bench_finish(script, &run);
+    return run.seconds;
+}
+
+int main(int argc, char **argv) {
+    const char *shell = BENCH_SHELL;
+    long count = DEFAULT_COUNT, expr_count = DEFAULT_EXPR_COUNT;
+    double arith, expr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:e:")) != -1) {
+        switch (opt) {
+            case 's': shell = optarg; break;
+            case 'n': count = atol(optarg); break;
+            case 'e': expr_count = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: bench_arith [-s shell] [-n count] "
+                        "[-e expr_count]\n");
+                return 2;
+        }
+    }
+    if (count <= 0 || expr_count <= 0) {
+        fprintf(stderr, "bench_arith: counts must be positive\n");
+        return 2;
+    }
+
+    arith = run_loop(shell, "i=$((i + 1))\n", count);
+    expr = run_loop(shell, "i=$(expr $i + 1)\n", expr_count);
+
+    printf("%-8s %12s %14s %12s\n", "loop", "iterations", "per iter (us)",
+           "total (s)");
+    printf("%-8s %12ld %14.2f %12.3f\n", "$(( ))", count, arith / count * 1e6,
+           arith);
+    printf("%-8s %12ld %14.2f %12.3f%s\n", "expr", expr_count,
+           expr / expr_count * 1e6, expr / expr_count * count,
+           expr_count == count ? "" : " (scaled)");
+    printf("speedup  %.1fx\n", (expr / expr_count) / (arith / count));
+    return 0;
+}
@@ -0,0 +1,157 @@
+// Launch latency against the size of the shell's heap, with and without
+// the fork server:
+//
+//     bench_launch [-s shell] [-n launches] [-m MB,MB,...]
+//
+// For each size the shell first grows its heap with assignments of large
+// values, kept in its history. Then it runs this program launches times.
+// Each run stamps when it started and when it is about to exit, and the
+// latency of a launch is the time from one run's exit to the next one's
+// start: reaping, reading the line and launching it
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define DEFAULT_LAUNCHES 1000
+#define DEFAULT_SIZES    "0,64,256,1024"
+#define FILL_VALUE       (1 << 20)
+#define STAMP_MODE       "--stamp"
+
+// Resident size of a process in MB, from /proc
+static double rss_of(pid_t pid) {
+    char path[64], line[128];
+    double kb = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    if (!(f = fopen(path, "r")))
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmRSS:", 6))
+            kb = atof(line + 6);
+    }
+    fclose(f);
+    return kb / 1024;
+}
+
+// Run i of n: its start and exit times go to slots 2i and 2i + 1 of the
+// stamp file, the first run also writes the shell's size after them
+static int stamp(const char *path, long i, long n) {
+    double t = bench_now(), rss;
+    int fd = open(path, O_WRONLY);
+
+    if (fd == -1 || pwrite(fd, &t, sizeof(t), 2 * i * sizeof(t)) == -1)
+        return 1;
+    if (i == 0) {
+        rss = rss_of(getppid());
+        if (pwrite(fd, &rss, sizeof(rss), 2 * n * sizeof(t)) == -1)
+            return 1;
+    }
+    t = bench_now();
+    if (pwrite(fd, &t, sizeof(t), (2 * i + 1) * sizeof(t)) == -1)
+        return 1;
+    close(fd);
+    return 0;
+}
+
+static void run(const char *shell, const char *mode, long mb, long n,
+                const char *self, const char *path, double *stamps,
+                double *latency) {
+    char *value = (char *) malloc(FILL_VALUE + 1);
+    struct bench_run r;
+    double rss = 0;
+    FILE *script;
+    long i;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_TRUNC)) == -1)
+        bench_die(path);
+
+    // Each line keeps about twice the value: once in the history, once
+    // left behind by setenv()
+    memset(value, 'a', FILL_VALUE);
+    value[FILL_VALUE] = 0;
+    script = bench_start(shell, mode, -1);
+    for (i = 0; i < mb * 1024 * 1024 / (2 * FILL_VALUE); i++)
+        fprintf(script, "h=%s\n", value);
+    fprintf(script, "h=\n");
+    for (i = 0; i < n; i++)
+        fprintf(script, "%s %s %s %ld %ld\n", self, STAMP_MODE, path, i, n);
+    bench_finish(script, &r);
+
+    if (pread(fd, stamps, 2 * n * sizeof(double), 0) !=
+        (ssize_t) (2 * n * sizeof(double)) ||
+        pread(fd, &rss, sizeof(rss), 2 * n * sizeof(double)) != sizeof(rss)) {
+        fprintf(stderr, "bench_launch: the runs left no stamps\n");
+        exit(1);
+    }
+    close(fd);
+
+    for (i = 1; i < n; i++)
+        latency[i - 1] = stamps[2 * i] - stamps[2 * i - 1];
+    bench_sort(latency, n - 1);
+    printf("%-12s %8ld %8.0f %10.1f %10.1f %10.1f\n",
+           mode ? "fork server" : "fork", mb, rss,
+           bench_percentile(latency, n - 1, 0.5) * 1e6,
+           bench_percentile(latency, n - 1, 0.99) * 1e6,
+           latency[n - 2] * 1e6);
+    free(value);
+}
+
+int main(int argc, char **argv) {
+    const char *shell = BENCH_SHELL, *sizes = DEFAULT_SIZES, *s;
+    char path[] = "/tmp/bench_launch.XXXXXX", self[PATH_MAX];
+    double *stamps, *latency;
+    long n = DEFAULT_LAUNCHES, mb;
+    ssize_t len;
+    char *end;
+    int opt, fd;
+
+    if (argc == 5 && !strcmp(argv[1], STAMP_MODE))
+        return stamp(argv[2], atol(argv[3]), atol(argv[4]));
+
+    while ((opt = getopt(argc, argv, "s:n:m:")) != -1) {
+        switch (opt) {
+            case 's': shell = optarg; break;
+            case 'n': n = atol(optarg); break;
+            case 'm': sizes = optarg; break;
+            default:
+                fprintf(stderr, "usage: bench_launch [-s shell] [-n launches] "
+                        "[-m MB,MB,...]\n");
+                return 2;
+        }
+    }
+    if (n < 2) {
+        fprintf(stderr, "bench_launch: at least 2 launches are needed\n");
+        return 2;
+    }
+    if ((len = readlink("/proc/self/exe", self, sizeof(self) - 1)) == -1)
+        bench_die("/proc/self/exe");
+    self[len] = 0;
+    if ((fd = mkstemp(path)) == -1)
+        bench_die("stamp file");
+    close(fd);
+
+    stamps = (double *) malloc(2 * n * sizeof(double));
+    latency = (double *) malloc(n * sizeof(double));
+    printf("%-12s %8s %8s %10s %10s %10s\n", "launch", "fill MB", "RSS MB",
+           "p50 (us)", "p99 (us)", "max (us)");
+    for (s = sizes; *s; s = *end ? end + 1 : end) {
+        mb = strtol(s, &end, 10);
+        if (end == s || (*end && *end != ',')) {
+            fprintf(stderr, "bench_launch: bad size list \"%s\"\n", sizes);
+            return 2;
+        }
+        run(shell, NULL, mb, n, self, path, stamps, latency);
+        run(shell, "--fork-server", mb, n, self, path, stamps, latency);
+    }
+
+    unlink(path);
+    free(stamps);
+    free(latency);
+    return 0;
+}
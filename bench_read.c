@@ -0,0 +1,99 @@
+// Reads count lines with the read builtin, one read per line as a while
+// read loop would. The shell has no loop construct, so the script is the
+// loop unrolled:
+//
+//     bench_read [-s shell] [-n count] [-b byte_count]
+//
+// The lines come first from the shell's own stdin, interleaved with the
+// read commands, which the shell owns and reads a block at a time. Then
+// byte_count lines come on descriptor 3, from a file read ahead and
+// rewound, and from a pipe read a byte at a time. Each run reports
+// lines/s and read(2) calls per line
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#define DEFAULT_COUNT      10000000
+#define DEFAULT_BYTE_COUNT 1000000
+#define LINE_FORMAT        "%ld\tsome payload of a typical log line\n"
+
+static void report(const char *name, long count, struct bench_run *run) {
+    printf("%-9s %10ld %10.3f %12.0f %10.3f\n", name, count, run->seconds,
+           count / run->seconds, (double) run->read_calls / count);
+}
+
+int main(int argc, char **argv) {
+    const char *shell = BENCH_SHELL;
+    long count = DEFAULT_COUNT, byte_count = DEFAULT_BYTE_COUNT, i;
+    struct bench_run run;
+    FILE *script, *data;
+    int opt, fd[2];
+    pid_t writer;
+
+    while ((opt = getopt(argc, argv, "s:n:b:")) != -1) {
+        switch (opt) {
+            case 's': shell = optarg; break;
+            case 'n': count = atol(optarg); break;
+            case 'b': byte_count = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: bench_read [-s shell] [-n count] "
+                        "[-b byte_count]\n");
+                return 2;
+        }
+    }
+
+    printf("%-9s %10s %10s %12s %10s\n", "input", "lines", "time (s)",
+           "lines/s", "reads/line");
+
+    if (count > 0) {
+        script = bench_start(shell, NULL, -1);
+        for (i = 0; i < count; i++) {
+            fputs("read -r line\n", script);
+            fprintf(script, LINE_FORMAT, i);
+        }
+        bench_finish(script, &run);
+        report("stdin", count, &run);
+    }
+
+    if (byte_count > 0) {
+        if (!(data = tmpfile()))
+            bench_die("tmpfile");
+        for (i = 0; i < byte_count; i++)
+            fprintf(data, LINE_FORMAT, i);
+        fflush(data);
+        rewind(data);
+        script = bench_start(shell, NULL, fileno(data));
+        for (i = 0; i < byte_count; i++)
+            fputs("read -r -u 3 line\n", script);
+        bench_finish(script, &run);
+        report("file", byte_count, &run);
+        fclose(data);
+
+        // A pipe has no offset to rewind, the only safe way is a byte at
+        // a time
+        if (pipe(fd) == -1)
+            bench_die("pipe");
+        if ((writer = fork()) == 0) {
+            close(fd[0]);
+            if (!(data = fdopen(fd[1], "w")))
+                _exit(1);
+            for (i = 0; i < byte_count; i++)
+                fprintf(data, LINE_FORMAT, i);
+            fclose(data);
+            _exit(0);
+        }
+        if (writer == -1)
+            bench_die("fork");
+        close(fd[1]);
+        script = bench_start(shell, NULL, fd[0]);
+        close(fd[0]);
+        for (i = 0; i < byte_count; i++)
+            fputs("read -r -u 3 line\n", script);
+        bench_finish(script, &run);
+        report("pipe", byte_count, &run);
+        waitpid(writer, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+// Command substitution latency. The shell runs count assignments of each
+// kind, and the time of plain x=1 assignments is taken off, leaving what
+// the substitution itself costs:
+//
+//     bench_subst [-s shell] [-n count]
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+#define DEFAULT_COUNT 10000
+
+static const struct {
+    const char *name;
+    const char *line;
+} kinds[] = {
+    {"none", "x=1\n"},
+    {"builtin", "x=$(jobs)\n"},
+    {"external", "x=$(true)\n"},
+    {"backtick", "x=`true`\n"},
+    {"pipeline", "x=$(true | true)\n"}
+};
+
+int main(int argc, char **argv) {
+    const char *shell = BENCH_SHELL;
+    struct bench_run run;
+    double base = 0;
+    long count = DEFAULT_COUNT, i;
+    size_t k;
+    FILE *script;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+        switch (opt) {
+            case 's': shell = optarg; break;
+            case 'n': count = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: bench_subst [-s shell] [-n count]\n");
+                return 2;
+        }
+    }
+    if (count <= 0)
+        count = DEFAULT_COUNT;
+
+    printf("%-10s %10s %12s\n", "kind", "total (s)", "per subst (us)");
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        script = bench_start(shell, NULL, -1);
+        for (i = 0; i < count; i++)
+            fputs(kinds[k].line, script);
+        bench_finish(script, &run);
+
+        if (k == 0)
+            base = run.seconds;
+        printf("%-10s %10.3f %12.1f\n", kinds[k].name, run.seconds,
+               k == 0 ? 0 : (run.seconds - base) / count * 1e6);
+    }
+    return 0;
+}
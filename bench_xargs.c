@@ -0,0 +1,97 @@
+// Batching of a file list, the xargs builtin against the xargs program:
+//
+//     bench_xargs [-s shell] [-n count] [-x xargs]
+//
+// Both run "cat list | xargs target" on count generated filenames. The
+// target is this program again, which only counts its runs, so the forks
+// of each run are what the batching made
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bench.h"
+
+#define DEFAULT_COUNT 1000000
+#define DEFAULT_XARGS "/usr/bin/xargs"
+#define COUNT_MODE    "--count-run"
+
+// One byte per run, appended so parallel batches cannot lose any
+static int count_run(const char *path) {
+    int fd = open(path, O_WRONLY | O_APPEND);
+
+    if (fd == -1 || write(fd, "", 1) != 1)
+        return 1;
+    close(fd);
+    return 0;
+}
+
+static void run(const char *shell, const char *name, const char *xargs,
+                const char *list, const char *counter, const char *self,
+                long count) {
+    struct bench_run r;
+    struct stat st;
+    FILE *script;
+
+    if (truncate(counter, 0) == -1)
+        bench_die(counter);
+    script = bench_start(shell, NULL, -1);
+    fprintf(script, "cat %s | %s %s %s %s\n", list, xargs, self, COUNT_MODE,
+            counter);
+    bench_finish(script, &r);
+
+    if (stat(counter, &st) == -1)
+        bench_die(counter);
+    printf("%-9s %10ld %10lld %10.3f %12.0f\n", name, count,
+           (long long) st.st_size, r.seconds, count / r.seconds);
+}
+
+int main(int argc, char **argv) {
+    const char *shell = BENCH_SHELL, *xargs = DEFAULT_XARGS;
+    char list[] = "/tmp/bench_xargs_list.XXXXXX";
+    char counter[] = "/tmp/bench_xargs_count.XXXXXX";
+    char self[PATH_MAX];
+    long count = DEFAULT_COUNT, i;
+    ssize_t n;
+    FILE *f;
+    int opt, fd;
+
+    if (argc >= 3 && !strcmp(argv[1], COUNT_MODE))
+        return count_run(argv[2]);
+
+    while ((opt = getopt(argc, argv, "s:n:x:")) != -1) {
+        switch (opt) {
+            case 's': shell = optarg; break;
+            case 'n': count = atol(optarg); break;
+            case 'x': xargs = optarg; break;
+            default:
+                fprintf(stderr, "usage: bench_xargs [-s shell] [-n count] "
+                        "[-x xargs]\n");
+                return 2;
+        }
+    }
+    if ((n = readlink("/proc/self/exe", self, sizeof(self) - 1)) == -1)
+        bench_die("/proc/self/exe");
+    self[n] = 0;
+
+    if ((fd = mkstemp(list)) == -1 || !(f = fdopen(fd, "w")))
+        bench_die("list");
+    for (i = 0; i < count; i++)
+        fprintf(f, "src/module%04ld/file%07ld.c\n", i % 1000, i);
+    fclose(f);
+    if ((fd = mkstemp(counter)) == -1)
+        bench_die("counter");
+    close(fd);
+
+    printf("%-9s %10s %10s %10s %12s\n", "xargs", "items", "forks",
+           "time (s)", "items/s");
+    run(shell, "builtin", "xargs", list, counter, self, count);
+    run(shell, "program", xargs, list, counter, self, count);
+    printf("The program also forks itself once\n");
+
+    unlink(list);
+    unlink(counter);
+    return 0;
+}
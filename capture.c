@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include "color.h"
+#include "watchdog.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Captures whose job may still write
+static Capture active[MAX_CAPTURES];
+static int nactive = 0;
+
+// Self-pipe written on SIGCHLD
+static int wake[2] = { -1, -1 };
+
+static void note_child(int signo) {
+    int saved = errno;
+
+    write(wake[1], "", 1);
+    errno = saved;
+}
+
+// Set up along with the first capture or deadline. SIGCHLD then wakes
+// the event loop through a pipe, so a child changing state right before
+// the poll is never missed
+int event_loop_init() {
+    struct sigaction sa;
+
+    if (wake[0] >= 0)
+        return 0;
+    if (pipe2(wake, O_NONBLOCK | O_CLOEXEC) == -1)
+        return -1;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = note_child;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    return 0;
+}
+
+// Creates a capture and returns the write end its job should get
+// instead of stdout and stderr. NULL when no more captures can be open
+Capture open_capture(int *write_end) {
+    Capture c;
+    int fd[2];
+
+    if (nactive == MAX_CAPTURES || event_loop_init() == -1 ||
+        pipe2(fd, O_CLOEXEC) == -1)
+        return NULL;
+
+    // Only the shell's end is non-blocking
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+    c = (Capture) calloc(1, sizeof(struct capture));
+    c->fd = fd[0];
+    c->buf = (char *) malloc(CAPTURE_SIZE);
+    active[nactive++] = c;
+
+    *write_end = fd[1];
+    return c;
+}
+
+static void deactivate(Capture c) {
+    int i;
+
+    for (i = 0; i < nactive && active[i] != c; i++);
+    if (i < nactive)
+        active[i] = active[--nactive];
+    close(c->fd);
+    c->fd = -1;
+}
+
+void close_capture(Capture c) {
+    if (c) {
+        if (c->fd >= 0)
+            deactivate(c);
+        free(c->buf);
+        free(c);
+    }
+}
+
+// Whether blocking calls must go through the event loop. A metrics file
+// is kept current from its timeout, so even an idle shell dumps on time
+int event_loop_active() {
+    return nactive > 0 || watchdog_active() ||
+           (metrics_due() >= 0 && event_loop_init() == 0);
+}
+
+// Reads what the job wrote straight into the ring, wrapping at its end.
+// At most one ring's worth per call, so a chatty job cannot starve others
+static void drain(Capture c) {
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < CAPTURE_SIZE) {
+        size_t at = c->total % CAPTURE_SIZE;
+
+        n = read(c->fd, &c->buf[at], CAPTURE_SIZE - at);
+        if (n > 0) {
+            got += n;
+            c->total += n;
+            c->len = c->len + n > CAPTURE_SIZE ? CAPTURE_SIZE : c->len + n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // Every writer is gone
+            if (n == 0 || errno != EAGAIN)
+                deactivate(c);
+            break;
+        }
+    }
+}
+
+// The event loop: sleeps until fd (if not -1) is readable, a child
+// changes state, output arrives, a deadline passes, metrics are due or a
+// signal interrupts, draining every capture in the meantime
+int capture_wait(int fd) {
+    struct pollfd pfds[MAX_CAPTURES + 3];
+    Capture polled[MAX_CAPTURES];
+    char junk[64];
+    int i, n = nactive;
+
+    pfds[0].fd = wake[0];
+    pfds[0].events = POLLIN;
+    pfds[1].fd = fd;
+    pfds[1].events = POLLIN;
+    pfds[2].fd = watchdog_fd();
+    pfds[2].events = POLLIN;
+    for (i = 0; i < n; i++) {
+        polled[i] = active[i];
+        pfds[i + 3].fd = active[i]->fd;
+        pfds[i + 3].events = POLLIN;
+    }
+
+    if (poll(pfds, n + 3, metrics_due()) == -1) {
+        // A SIGCHLD always leaves a byte behind
+        return read(wake[0], junk, sizeof(junk)) > 0 ? CW_EVENT : CW_INTR;
+    }
+    metrics_tick(0);
+
+    for (i = 0; i < n; i++) {
+        if (pfds[i + 3].revents)
+            drain(polled[i]);
+    }
+    if (pfds[2].revents)
+        watchdog_fire();
+    if (pfds[0].revents)
+        while (read(wake[0], junk, sizeof(junk)) > 0);
+
+    return fd >= 0 && pfds[1].revents ? CW_READY : CW_EVENT;
+}
+
+// waitpid() that keeps the event loop running while it blocks
+pid_t capture_waitpid(pid_t pid, int *status, int options) {
+    pid_t r;
+
+    while (event_loop_active() && !(options & WNOHANG)) {
+        if ((r = waitpid(pid, status, options | WNOHANG)) != 0)
+            return r;
+        if (capture_wait(-1) == CW_INTR) {
+            errno = EINTR;
+            return -1;
+        }
+    }
+    return waitpid(pid, status, options);
+}
+
+// Writes the output kept from offset from on, returns where it stopped
+uint64_t capture_print(Capture c, uint64_t from) {
+    if (from < c->total - c->len)
+        from = c->total - c->len;
+
+    while (from < c->total) {
+        size_t at = from % CAPTURE_SIZE;
+        size_t n = c->total - from < CAPTURE_SIZE - at ? c->total - from
+                                                       : CAPTURE_SIZE - at;
+
+        term_write(&c->buf[at], n);
+        from += n;
+    }
+    term_flush();
+    return from;
+}
+
+// Offset of the start of the last lines lines kept
+uint64_t capture_tail(Capture c, int lines) {
+    uint64_t start = c->total - c->len, at = c->total;
+
+    if (lines <= 0)
+        return at;
+
+    // The newline ending the output does not start a line
+    if (at > start && c->buf[(at - 1) % CAPTURE_SIZE] == '\n')
+        at--;
+    for (; at > start; at--) {
+        if (c->buf[(at - 1) % CAPTURE_SIZE] == '\n' && --lines == 0)
+            break;
+    }
+    return at;
+}
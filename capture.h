@@ -0,0 +1,36 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+    #include <stdint.h>
+    #include <sys/types.h>
+
+    // Bytes kept per captured job, older output is overwritten
+    #define CAPTURE_SIZE  65536
+    #define MAX_CAPTURES  64
+
+    // capture_wait() results
+    #define CW_INTR      -1  // interrupted by a signal other than SIGCHLD
+    #define CW_EVENT      0  // output arrived or a child changed state
+    #define CW_READY      1  // the descriptor waited for is readable
+
+    typedef struct capture *Capture;
+
+    // Ring holding the last len bytes of a job's output, which end at
+    // offset total of everything the job ever wrote
+    struct capture {
+        int      fd;
+        char     *buf;
+        size_t   len;
+        uint64_t total;
+    };
+
+    Capture  open_capture(int *);
+    void     close_capture(Capture);
+    int      event_loop_init();
+    int      event_loop_active();
+    int      capture_wait(int);
+    pid_t    capture_waitpid(pid_t, int *, int);
+    uint64_t capture_print(Capture, uint64_t);
+    uint64_t capture_tail(Capture, int);
+
+#endif
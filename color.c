@@ -1,7 +1,156 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "color.h"
 
+// The shell's output to stdout is collected in a frame, colors and text
+// alike, and written with a single writev when the shell is about to wait
+// on something: a prompt, a job, a fork. Colors point at the constant
+// escape strings, text is copied into the frame's buffer
+static struct iovec segments[TERM_SEGMENTS];
+static int          nsegments = 0;
+static char         text[TERM_TEXT];
+static size_t       text_len = 0;
+
+// Decided when a frame starts, so output going to a pipe or a file, such
+// as a command substitution, gets no escape codes
+static int colors = -1;
+
+static int use_colors() {
+    const char *no_color;
+    int saved = errno;
+
+    // Callers print errno after setting the color
+    if (colors < 0) {
+        no_color = getenv("NO_COLOR");
+        colors = (!no_color || !*no_color) && isatty(STDOUT_FILENO);
+        errno = saved;
+    }
+    return colors;
+}
+
+static void write_all(const char *buf, size_t n) {
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(STDOUT_FILENO, buf, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        buf += w;
+        n -= w;
+    }
+}
+
+static void add_segment(const char *buf, size_t n) {
+    struct iovec *last;
+
+    // Text following text grows the same segment
+    if (nsegments > 0) {
+        last = &segments[nsegments - 1];
+        if ((char *) last->iov_base + last->iov_len == buf) {
+            last->iov_len += n;
+            return;
+        }
+    }
+    segments[nsegments].iov_base = (void *) buf;
+    segments[nsegments].iov_len = n;
+    nsegments++;
+}
+
 void set_color(const char* color) {
-    printf("%s", color);
+    if (!use_colors())
+        return;
+    if (nsegments == TERM_SEGMENTS)
+        term_flush();
+    add_segment(color, strlen(color));
+}
+
+void term_write(const char *buf, size_t n) {
+    if (nsegments == TERM_SEGMENTS || n > TERM_TEXT - text_len)
+        term_flush();
+
+    // Too large for any frame
+    if (n > TERM_TEXT) {
+        write_all(buf, n);
+        return;
+    }
+    memcpy(&text[text_len], buf, n);
+    add_segment(&text[text_len], n);
+    text_len += n;
+}
+
+void term_printf(const char *fmt, ...) {
+    va_list ap;
+    char *big;
+    int n;
+
+    if (nsegments == TERM_SEGMENTS)
+        term_flush();
+
+    va_start(ap, fmt);
+    n = vsnprintf(&text[text_len], TERM_TEXT - text_len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+
+    // Did not fit in what is left, format again into an empty frame or,
+    // if too large for any, on its own
+    if ((size_t) n >= TERM_TEXT - text_len) {
+        term_flush();
+        va_start(ap, fmt);
+        if (n < TERM_TEXT) {
+            vsnprintf(text, TERM_TEXT, fmt, ap);
+        } else {
+            big = (char *) malloc(n + 1);
+            vsnprintf(big, n + 1, fmt, ap);
+            write_all(big, n);
+            free(big);
+            n = 0;
+        }
+        va_end(ap);
+    }
+
+    if (n > 0) {
+        add_segment(&text[text_len], n);
+        text_len += n;
+    }
+}
+
+// Ends the frame, writing it in one go
+void term_flush() {
+    struct iovec *iov = segments;
+    int left = nsegments, saved = errno;
+    ssize_t w;
+
+    // Anything still printed through stdio goes first
     fflush(stdout);
+
+    while (left > 0) {
+        if ((w = writev(STDOUT_FILENO, iov, left)) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // Short write, skip what went through
+        while (left > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char *) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    nsegments = 0;
+    text_len = 0;
+    colors = -1;
+    errno = saved;
 }
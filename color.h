@@ -1,6 +1,8 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+    #include <stddef.h>
+
     #define RED         "\033[1;31m"
     #define CYAN        "\033[1;36m"
     #define GREEN       "\033[1;32m"
@@ -13,5 +15,12 @@
     #define WHITE       "\033[1;37m"
     #define NONE        "\033[0m"
 
+    // A frame is flushed early once it holds this many pieces or bytes
+    #define TERM_SEGMENTS 64
+    #define TERM_TEXT     16384
+
     void set_color(const char*);
+    void term_printf(const char*, ...) __attribute__((format(printf, 1, 2)));
+    void term_write(const char*, size_t);
+    void term_flush();
 #endif
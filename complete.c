@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include "complete.h"
+#include "process_control.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+extern Jobl job_list;
+
+// Builtins, in step with try_internal_cmd()
+static const char *builtins[] = {
+    "bg", "cd", "fg", "history", "jobs", "joblog", "limit", "memo", "quit",
+    "read", "set", "stats", "timeout", "ulimit", "wait", "xargs"
+};
+
+// Executables found in PATH, sorted by name. Built by a worker thread at
+// startup or when PATH changes, then kept current from inotify events on
+// the PATH directories instead of being read again
+struct indexed_cmd {
+    char     *name;
+    uint64_t dirs;   // bit i: executable in PATH directory i
+};
+
+struct cmd_index {
+    struct indexed_cmd *commands;
+    size_t n, cap;
+    char   *path;
+    char   **dirs;
+    int    *watches;
+    int    ndirs;
+    int    inotify_fd;
+};
+
+// The index completions use. Only the main thread touches it
+static struct cmd_index idx = { NULL, 0, 0, NULL, NULL, NULL, 0, -1 };
+
+// The one a worker built, waiting for the next completion to take it
+static struct {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    struct cmd_index built;
+    int              done;
+    int              busy;
+} indexing = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+               { NULL, 0, 0, NULL, NULL, NULL, 0, -1 }, 0, 0 };
+
+// Directories past the 63rd share the last bit
+static uint64_t dir_bit(int i) {
+    return 1ULL << (i < 63 ? i : 63);
+}
+
+// First entry not sorting before name
+static size_t lower_bound(const char *name, size_t len) {
+    size_t lo = 0, hi = idx.n, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (strncmp(idx.commands[mid].name, name, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void index_add(const char *name, int dir) {
+    size_t i = lower_bound(name, strlen(name) + 1);
+
+    if (i < idx.n && !strcmp(idx.commands[i].name, name)) {
+        idx.commands[i].dirs |= dir_bit(dir);
+        return;
+    }
+
+    if (idx.n == idx.cap) {
+        idx.cap = idx.cap ? 2 * idx.cap : 1024;
+        idx.commands = (struct indexed_cmd *) realloc(idx.commands, idx.cap *
+                                                      sizeof(*idx.commands));
+    }
+    memmove(&idx.commands[i + 1], &idx.commands[i],
+            (idx.n - i) * sizeof(*idx.commands));
+    idx.commands[i].name = strdup(name);
+    idx.commands[i].dirs = dir_bit(dir);
+    idx.n++;
+}
+
+static void index_remove_at(size_t i, int dir) {
+    if ((idx.commands[i].dirs &= ~dir_bit(dir)))
+        return;
+    free(idx.commands[i].name);
+    memmove(&idx.commands[i], &idx.commands[i + 1],
+            (idx.n - i - 1) * sizeof(*idx.commands));
+    idx.n--;
+}
+
+static void index_remove(const char *name, int dir) {
+    size_t i = lower_bound(name, strlen(name) + 1);
+
+    if (i < idx.n && !strcmp(idx.commands[i].name, name))
+        index_remove_at(i, dir);
+}
+
+static int is_executable(int dirfd, const char *name) {
+    struct stat st;
+
+    return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+           faccessat(dirfd, name, X_OK, 0) == 0;
+}
+
+// Appends the executables of directory i, unsorted
+static void scan_dir(struct cmd_index *x, int i) {
+    struct dirent *de;
+    DIR *d;
+
+    if (!(d = opendir(x->dirs[i])))
+        return;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.' || !is_executable(dirfd(d), de->d_name))
+            continue;
+        if (x->n == x->cap) {
+            x->cap = x->cap ? 2 * x->cap : 1024;
+            x->commands = (struct indexed_cmd *) realloc(x->commands, x->cap *
+                                                         sizeof(*x->commands));
+        }
+        x->commands[x->n].name = strdup(de->d_name);
+        x->commands[x->n].dirs = dir_bit(i);
+        x->n++;
+    }
+    closedir(d);
+}
+
+static int by_command(const void *a, const void *b) {
+    return strcmp(((const struct indexed_cmd *) a)->name,
+                  ((const struct indexed_cmd *) b)->name);
+}
+
+static void free_index(struct cmd_index *x) {
+    int i;
+    size_t j;
+
+    for (j = 0; j < x->n; j++)
+        free(x->commands[j].name);
+    for (i = 0; i < x->ndirs; i++)
+        free(x->dirs[i]);
+    free(x->commands);
+    free(x->dirs);
+    free(x->watches);
+    free(x->path);
+    if (x->inotify_fd >= 0)
+        close(x->inotify_fd);
+
+    memset(x, 0, sizeof(*x));
+    x->inotify_fd = -1;
+}
+
+// Worker thread: reads every PATH directory, then sorts once and merges
+// the names found in several of them
+static void *build_index(void *arg) {
+    struct cmd_index x = { NULL, 0, 0, (char *) arg, NULL, NULL, 0, -1 };
+    const char *p, *colon;
+    size_t i, j;
+    int k;
+
+    x.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    for (p = x.path; *p; p = *colon ? colon + 1 : colon) {
+        colon = strchrnul(p, ':');
+        if (colon == p)
+            continue;
+        x.dirs = (char **) realloc(x.dirs, (x.ndirs + 1) * sizeof(char *));
+        x.watches = (int *) realloc(x.watches, (x.ndirs + 1) * sizeof(int));
+        x.dirs[x.ndirs++] = strndup(p, colon - p);
+    }
+
+    // Watching first, nothing created during the scan is missed
+    for (k = 0; k < x.ndirs; k++) {
+        x.watches[k] = x.inotify_fd < 0 ? -1 :
+                       inotify_add_watch(x.inotify_fd, x.dirs[k],
+                                         IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                         IN_MOVED_FROM | IN_MOVED_TO |
+                                         IN_DELETE_SELF | IN_MOVE_SELF);
+        scan_dir(&x, k);
+    }
+
+    if (x.n > 0)
+        qsort(x.commands, x.n, sizeof(*x.commands), by_command);
+    for (i = j = 0; i < x.n; i++) {
+        if (j > 0 && !strcmp(x.commands[j - 1].name, x.commands[i].name)) {
+            x.commands[j - 1].dirs |= x.commands[i].dirs;
+            free(x.commands[i].name);
+        } else {
+            x.commands[j++] = x.commands[i];
+        }
+    }
+    x.n = j;
+
+    pthread_mutex_lock(&indexing.lock);
+    free_index(&indexing.built);
+    indexing.built = x;
+    indexing.done = 1;
+    indexing.busy = 0;
+    pthread_cond_broadcast(&indexing.cond);
+    pthread_mutex_unlock(&indexing.lock);
+    return NULL;
+}
+
+// Starts a worker on path, unless one is busy already. Called with the
+// lock held
+static void start_index(const char *path) {
+    pthread_t thread;
+    char *copy;
+
+    if (indexing.busy)
+        return;
+    copy = strdup(path);
+    if (pthread_create(&thread, NULL, build_index, copy) == 0) {
+        pthread_detach(thread);
+        indexing.busy = 1;
+    } else {
+        free(copy);
+    }
+}
+
+void complete_prepare() {
+    const char *path = getenv("PATH") ? getenv("PATH") : "";
+
+    pthread_mutex_lock(&indexing.lock);
+    start_index(path);
+    pthread_mutex_unlock(&indexing.lock);
+}
+
+// Takes an index a worker finished, starting one if PATH is not the one
+// indexed. The first completion waits for it as long as a keystroke waits
+// for a directory, then goes on with whatever is ready
+static void take_index(const char *path) {
+    struct timespec deadline;
+    int rc = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += COMPLETE_DEADLINE_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&indexing.lock);
+    if (!indexing.done && (!idx.path || strcmp(path, idx.path)))
+        start_index(path);
+    while (!idx.path && indexing.busy && rc == 0)
+        rc = pthread_cond_timedwait(&indexing.cond, &indexing.lock,
+                                    &deadline);
+    if (indexing.done) {
+        free_index(&idx);
+        idx = indexing.built;
+        memset(&indexing.built, 0, sizeof(indexing.built));
+        indexing.built.inotify_fd = -1;
+        indexing.done = 0;
+    }
+    pthread_mutex_unlock(&indexing.lock);
+}
+
+// Applies the changes inotify reported since the last completion. A new
+// PATH, or events the kernel had to drop, mean a new index, built in the
+// background while this one is still used
+static void update_index() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const char *path = getenv("PATH") ? getenv("PATH") : "";
+    struct inotify_event *ev;
+    size_t j;
+    ssize_t n;
+    char *p;
+    int i, fd;
+
+    take_index(path);
+    if (!idx.path || strcmp(path, idx.path))
+        return;
+
+    while (idx.inotify_fd >= 0 &&
+           (n = read(idx.inotify_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                pthread_mutex_lock(&indexing.lock);
+                start_index(path);
+                pthread_mutex_unlock(&indexing.lock);
+                return;
+            }
+
+            for (i = 0; i < idx.ndirs && idx.watches[i] != ev->wd; i++);
+            if (i == idx.ndirs)
+                continue;
+
+            if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                for (j = idx.n; j-- > 0;)
+                    index_remove_at(j, i);
+            } else if (ev->len == 0 || ev->name[0] == '.') {
+                continue;
+            } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                index_remove(ev->name, i);
+            } else if ((fd = open(idx.dirs[i], O_RDONLY | O_DIRECTORY |
+                                  O_CLOEXEC)) >= 0) {
+                // Created, moved in or with new permissions
+                if (is_executable(fd, ev->name))
+                    index_add(ev->name, i);
+                else
+                    index_remove(ev->name, i);
+                close(fd);
+            }
+        }
+    }
+}
+
+static void add_item(struct completions *c, const char *item, size_t len) {
+    if (c->n == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 32;
+        c->items = (char **) realloc(c->items, c->cap * sizeof(char *));
+    }
+    c->items[c->n++] = strndup(item, len);
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Sorts and drops duplicates
+static void finish(struct completions *c) {
+    int i, j;
+
+    qsort(c->items, c->n, sizeof(char *), by_name);
+    for (i = j = 0; i < c->n; i++) {
+        if (j > 0 && !strcmp(c->items[j - 1], c->items[i]))
+            free(c->items[i]);
+        else
+            c->items[j++] = c->items[i];
+    }
+    c->n = j;
+}
+
+static void complete_command(const char *word, size_t len,
+                             struct completions *c) {
+    size_t i;
+
+    for (i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (!strncmp(builtins[i], word, len))
+            add_item(c, builtins[i], strlen(builtins[i]));
+    }
+
+    update_index();
+    for (i = lower_bound(word, len);
+         i < idx.n && !strncmp(idx.commands[i].name, word, len); i++)
+        add_item(c, idx.commands[i].name, strlen(idx.commands[i].name));
+}
+
+static void complete_job(const char *word, size_t len,
+                         struct completions *c) {
+    Jobl_tail tail;
+    char spec[16];
+    int n;
+
+    for (tail = job_list->head; tail; tail = tail->next) {
+        if (tail->item->is_valid != VALID)
+            continue;
+        n = snprintf(spec, sizeof(spec), "%%%d", tail->item->jid);
+        if ((size_t) n >= len && !strncmp(spec, word, len))
+            add_item(c, spec, n);
+    }
+}
+
+// The last directory listed, by a worker thread so a slow file system
+// stalls the thread and never the keystroke waiting for it
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    char            *dir;
+    char            **names;   // directories with a trailing '/'
+    int             n;
+    int             done;
+    int             busy;
+    struct timespec listed;
+} listing = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+              NULL, NULL, 0, 0, 0, {0, 0} };
+
+static void free_names(char **names, int n) {
+    int i;
+
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+}
+
+static void *list_dir(void *arg) {
+    char *dir = (char *) arg, **names = NULL;
+    int n = 0, cap = 0, is_dir;
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    if ((d = opendir(dir))) {
+        while ((de = readdir(d))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            is_dir = de->d_type == DT_DIR;
+            if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+                is_dir = fstatat(dirfd(d), de->d_name, &st, 0) == 0 &&
+                         S_ISDIR(st.st_mode);
+            if (n == cap) {
+                cap = cap ? 2 * cap : 64;
+                names = (char **) realloc(names, cap * sizeof(char *));
+            }
+            names[n] = (char *) malloc(strlen(de->d_name) + 2);
+            strcpy(names[n], de->d_name);
+            if (is_dir)
+                strcat(names[n], "/");
+            n++;
+        }
+        closedir(d);
+    }
+
+    pthread_mutex_lock(&listing.lock);
+    if (listing.dir && !strcmp(listing.dir, dir)) {
+        free_names(listing.names, listing.n);
+        listing.names = names;
+        listing.n = n;
+        listing.done = 1;
+        clock_gettime(CLOCK_MONOTONIC, &listing.listed);
+        names = NULL;
+        n = 0;
+    }
+    listing.busy = 0;
+    pthread_cond_broadcast(&listing.cond);
+    pthread_mutex_unlock(&listing.lock);
+
+    free_names(names, n);
+    free(dir);
+    return NULL;
+}
+
+static long ms_since(struct timespec *t) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 +
+           (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+static int complete_file(const char *word, size_t len,
+                         struct completions *c) {
+    const char *slash = (const char *) memrchr(word, '/', len);
+    size_t dir_len = slash ? (size_t) (slash - word) + 1 : 0;
+    char dir[PATH_MAX];
+    struct timespec deadline;
+    pthread_t thread;
+    int i, rc = 0;
+
+    if (dir_len)
+        snprintf(dir, sizeof(dir), "%.*s", (int) dir_len, word);
+    else
+        strcpy(dir, ".");
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += COMPLETE_DEADLINE_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&listing.lock);
+
+    // A fresh listing is used as it is, otherwise a worker reads the
+    // directory, unless one is still busy, maybe on it already
+    if (!listing.busy &&
+        (!listing.dir || strcmp(listing.dir, dir) || !listing.done ||
+         ms_since(&listing.listed) > LISTING_TTL_MS)) {
+        free(listing.dir);
+        listing.dir = strdup(dir);
+        listing.done = 0;
+        if (pthread_create(&thread, NULL, list_dir, strdup(dir)) == 0) {
+            pthread_detach(thread);
+            listing.busy = 1;
+        }
+    }
+
+    while (listing.busy && rc == 0 &&
+           !(listing.done && !strcmp(listing.dir, dir)))
+        rc = pthread_cond_timedwait(&listing.cond, &listing.lock, &deadline);
+
+    if (!listing.dir || strcmp(listing.dir, dir) || !listing.done) {
+        pthread_mutex_unlock(&listing.lock);
+        return COMPLETE_PENDING;
+    }
+
+    // Hidden files only when asked for
+    for (i = 0; i < listing.n; i++) {
+        const char *name = listing.names[i];
+
+        if ((name[0] == '.') != (len > dir_len && word[dir_len] == '.'))
+            continue;
+        if (!strncmp(name, word + dir_len, len - dir_len)) {
+            add_item(c, word, dir_len);
+            c->items[c->n - 1] = (char *) realloc(c->items[c->n - 1],
+                                                  dir_len + strlen(name) + 1);
+            strcpy(c->items[c->n - 1] + dir_len, name);
+        }
+    }
+    pthread_mutex_unlock(&listing.lock);
+    return 0;
+}
+
+// Collects the completions of a word: job specs after a '%', commands in
+// command position, files otherwise. Returns how many there are, or
+// COMPLETE_PENDING if the directory could not be read in time
+int complete(const char *word, size_t len, int command,
+             struct completions *c) {
+    c->items = NULL;
+    c->n = c->cap = 0;
+
+    if (len > 0 && word[0] == '%')
+        complete_job(word, len, c);
+    else if (command && !memchr(word, '/', len))
+        complete_command(word, len, c);
+    else if (complete_file(word, len, c) == COMPLETE_PENDING)
+        return COMPLETE_PENDING;
+
+    finish(c);
+    return c->n;
+}
+
+void free_completions(struct completions *c) {
+    free_names(c->items, c->n);
+    c->items = NULL;
+    c->n = c->cap = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef COMPLETE_H
+#define COMPLETE_H
+
+    #include <stddef.h>
+
+    // Longest a keystroke waits for a directory to be listed. A slower
+    // listing is kept for the next one
+    #define COMPLETE_DEADLINE_MS 10
+    // How long a directory listing is reused before it is read again
+    #define LISTING_TTL_MS       1000
+
+    // complete() result when the directory is still being read
+    #define COMPLETE_PENDING     -1
+
+    // Candidates for a word, sorted. Directories end with a '/'
+    struct completions {
+        char **items;
+        int  n;
+        int  cap;
+    };
+
+    // Starts indexing the commands in PATH in the background
+    void complete_prepare();
+    int  complete(const char *, size_t, int, struct completions *);
+    void free_completions(struct completions *);
+
+#endif
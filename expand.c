@@ -0,0 +1,874 @@
+#include "expand.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "color.h"
+#include "wildcard.h"
+
+#define NAME_MAX_SIZE 256
+
+// Patterns of ${v/x/y} up to this many bytes are matched without
+// allocating
+#define PAT_STACK     64
+
+// Characters marked in the result of an expansion between double quotes,
+// and in any other, where only a stray mark must not pass for one
+#define QUOTED_GLOBS "*?[]\\\001\002"
+#define QUOTE_MARKS  "\001\002"
+
+struct arith {
+    const char *p;
+    const char *end;
+    const char *error;
+};
+
+// Binary operators, longest spelling first so "||" is never read as "|"
+static const struct {
+    const char *op;
+    int        len;
+    int        prec;
+} binops[] = {
+    {"||", 2, 1}, {"&&", 2, 2}, {"==", 2, 6}, {"!=", 2, 6}, {"<=", 2, 7},
+    {">=", 2, 7}, {"<<", 2, 8}, {">>", 2, 8}, {"|",  1, 3}, {"^",  1, 4},
+    {"&",  1, 5}, {"<",  1, 7}, {">",  1, 7}, {"+",  1, 9}, {"-",  1, 9},
+    {"*",  1, 10}, {"/",  1, 10}, {"%",  1, 10}
+};
+
+static int expand_into(struct strbuf *, const char *, size_t);
+static int64_t arith_ternary(struct arith *);
+
+// Makes room for n more bytes plus the terminating NUL
+void sb_reserve(struct strbuf *sb, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        size_t cap = sb->cap ? sb->cap : 64;
+
+        while (cap < sb->len + n + 1) cap *= 2;
+        sb->str = (char *) realloc(sb->str, cap);
+        sb->cap = cap;
+    }
+}
+
+void sb_putn(struct strbuf *sb, const char *str, size_t n) {
+    sb_reserve(sb, n);
+    memcpy(sb->str + sb->len, str, n);
+    sb->len += n;
+    sb->str[sb->len] = 0;
+}
+
+static void sb_putnum(struct strbuf *sb, int64_t value) {
+    char num[24];
+
+    sb_putn(sb, num, snprintf(num, sizeof(num), "%lld", (long long) value));
+}
+
+static void expand_error(const char *what, const char *str, size_t n) {
+    set_color(RED);
+    term_printf("ERROR: %s: \"%.*s\"\n", what, (int) n, str);
+    set_color(NONE);
+}
+
+// Length of the variable name at the start of str (0 if there is none)
+static size_t name_len(const char *str, size_t n) {
+    size_t i;
+
+    if (n == 0 || !(isalpha((unsigned char) str[0]) || str[0] == '_'))
+        return 0;
+    for (i = 1; i < n && (isalnum((unsigned char) str[i]) || str[i] == '_');
+         i++);
+    return i;
+}
+
+// Looks up a variable whose name is not NUL terminated, using the stack
+// for the key so that the lookup itself never allocates
+static const char *lookup(const char *name, size_t n) {
+    char key[NAME_MAX_SIZE];
+
+    if (n == 0 || n >= sizeof(key))
+        return NULL;
+    memcpy(key, name, n);
+    key[n] = 0;
+    return getenv(key);
+}
+
+// Index of the character closing the group opened at str[start]
+// ('(' or '{'), or n when the group is unbalanced
+static size_t group_end(const char *str, size_t n, size_t start) {
+    const char open = str[start], close = open == '(' ? ')' : '}';
+    size_t i;
+    int depth = 0;
+
+    for (i = start; i < n; i++) {
+        if (str[i] == open) depth++;
+        else if (str[i] == close && --depth == 0) return i;
+    }
+    return n;
+}
+
+// Matches the bracket expression starting just after '['. Returns the
+// number of pattern bytes consumed including the closing ']', or 0 when
+// the expression is malformed and '[' should be taken literally
+static size_t match_class(const char *p, size_t pn, char c, int *hit) {
+    size_t i = 0, first;
+    int neg = 0;
+
+    *hit = 0;
+    if (i < pn && (p[i] == '!' || p[i] == '^')) {
+        neg = 1;
+        i++;
+    }
+
+    // A ']' right after the opening bracket is a literal
+    for (first = i; i < pn && (i == first || p[i] != ']'); i++) {
+        unsigned char lo = p[i], hi;
+
+        if (lo == '\\' && i + 1 < pn) lo = p[++i];
+        hi = lo;
+        if (i + 2 < pn && p[i + 1] == '-' && p[i + 2] != ']') {
+            hi = p[i + 2];
+            i += 2;
+        }
+        if ((unsigned char) c >= lo && (unsigned char) c <= hi) *hit = 1;
+    }
+
+    if (i >= pn) return 0;
+    if (neg) *hit = !*hit;
+    return i + 1;
+}
+
+// Shell pattern matching ('*', '?', '[...]' and '\' escapes) over
+// counted strings, so callers can match prefixes and suffixes in place.
+// Backtracks only to the last '*', which keeps it linear for most patterns
+int match_pattern(const char *p, size_t pn, const char *str, size_t sn) {
+    size_t pi = 0, si = 0, star_p = (size_t) -1, star_s = 0;
+
+    while (si < sn) {
+        if (pi < pn) {
+            char c = p[pi];
+
+            if (c == '*') {
+                star_p = ++pi;
+                star_s = si;
+                continue;
+            }
+            if (c == '?') {
+                pi++;
+                si++;
+                continue;
+            }
+            if (c == '[') {
+                int hit;
+                size_t used = match_class(&p[pi + 1], pn - pi - 1,
+                                          str[si], &hit);
+
+                if (used && hit) {
+                    pi += used + 1;
+                    si++;
+                    continue;
+                }
+                if (used) goto backtrack;
+            }
+            if (c == '\\' && pi + 1 < pn) c = p[++pi];
+            if (c == str[si]) {
+                pi++;
+                si++;
+                continue;
+            }
+        }
+    backtrack:
+        if (star_p == (size_t) -1) return 0;
+        pi = star_p;
+        si = ++star_s;
+    }
+
+    while (pi < pn && p[pi] == '*') pi++;
+    return pi == pn;
+}
+
+// One element of a pattern, as find_match() runs it
+struct pat_elem {
+    char   type;   // 'c' a character, '?', '[' a bracket expression or '*'
+    char   c;
+    size_t off;    // Bracket expression, just after its '['
+    size_t len;
+};
+
+// Splits the pattern into elements, runs of '*' collapsing into one.
+// Returns how many, at most pn
+static size_t pattern_elems(const char *p, size_t pn, struct pat_elem *e) {
+    size_t i = 0, n = 0, used;
+    int hit;
+
+    while (i < pn) {
+        if (p[i] == '*') {
+            if (n == 0 || e[n - 1].type != '*') e[n++].type = '*';
+            i++;
+            continue;
+        }
+        if (p[i] == '?') {
+            e[n++].type = '?';
+            i++;
+            continue;
+        }
+        if (p[i] == '[' &&
+            (used = match_class(&p[i + 1], pn - i - 1, 0, &hit)) > 0) {
+            e[n].type = '[';
+            e[n].off = i + 1;
+            e[n++].len = used;
+            i += used + 1;
+            continue;
+        }
+        if (p[i] == '\\' && i + 1 < pn) i++;
+        e[n].type = 'c';
+        e[n++].c = p[i++];
+    }
+    return n;
+}
+
+static int elem_matches(const char *p, const struct pat_elem *e, char c) {
+    int hit;
+
+    if (e->type == '?') return 1;
+    if (e->type == 'c') return e->c == c;
+    match_class(&p[e->off], e->len, c, &hit);
+    return hit;
+}
+
+// Finds the leftmost longest non-empty match in str[from..sn). The
+// elements run as an automaton, each state keeping the earliest start
+// that reached it, so a scan is linear in the string for a given pattern.
+// cur and next hold ne + 1 states. Returns the start and sets *end, or
+// returns -1 when nothing matches
+static ssize_t find_match(const char *p, const struct pat_elem *e, size_t ne,
+                          const char *str, size_t from, size_t sn,
+                          size_t *end, size_t *cur, size_t *next) {
+    const size_t none = (size_t) -1;
+    size_t pos, best = none, j, *swap;
+    int alive;
+
+    for (j = 0; j <= ne; j++) cur[j] = none;
+    for (pos = from;; pos++) {
+        // Until something matches, a new attempt starts at every position
+        if (best == none && cur[0] == none) cur[0] = pos;
+        for (j = 0; j < ne; j++) {
+            if (e[j].type == '*' && cur[j] < cur[j + 1]) cur[j + 1] = cur[j];
+        }
+        if (cur[ne] < pos && cur[ne] <= best) {
+            best = cur[ne];
+            *end = pos;
+        }
+        if (pos == sn) break;
+
+        // Attempts starting after the best match can no longer win
+        alive = 0;
+        for (j = 0; j <= ne; j++) next[j] = none;
+        for (j = 0; j < ne; j++) {
+            if (cur[j] == none || (best != none && cur[j] > best)) continue;
+            if (e[j].type == '*') {
+                if (cur[j] < next[j]) next[j] = cur[j];
+            } else if (elem_matches(p, &e[j], str[pos]) &&
+                       cur[j] < next[j + 1]) {
+                next[j + 1] = cur[j];
+            }
+            alive = 1;
+        }
+        swap = cur;
+        cur = next;
+        next = swap;
+        if (!alive && best != none) break;
+    }
+    return best == none ? -1 : (ssize_t) best;
+}
+
+static void arith_skip(struct arith *a) {
+    while (a->p < a->end && isspace((unsigned char) *a->p)) a->p++;
+}
+
+// Numbers, variables (with or without '$'), parentheses and unary operators
+static int64_t arith_primary(struct arith *a) {
+    const char *start;
+    char *num_end;
+    int64_t value;
+    size_t n;
+
+    arith_skip(a);
+    if (a->error) return 0;
+    if (a->p >= a->end) {
+        a->error = "missing operand";
+        return 0;
+    }
+
+    switch (*a->p) {
+        case '(':
+            a->p++;
+            value = arith_ternary(a);
+            arith_skip(a);
+            if (a->p < a->end && *a->p == ')') a->p++;
+            else if (!a->error) a->error = "missing ')'";
+            return value;
+        case '+':
+            a->p++;
+            return arith_primary(a);
+        case '-':
+            a->p++;
+            return (int64_t) (0 - (uint64_t) arith_primary(a));
+        case '!':
+            a->p++;
+            return !arith_primary(a);
+        case '~':
+            a->p++;
+            return ~arith_primary(a);
+    }
+
+    if (isdigit((unsigned char) *a->p)) {
+        value = strtoll(a->p, &num_end, 0);
+        if (num_end > a->end) num_end = (char *) a->end;
+        a->p = num_end;
+        return value;
+    }
+
+    // Variables, optionally written as $name or ${name}
+    if (*a->p == '$') a->p++;
+    if (a->p < a->end && *a->p == '{') {
+        a->p++;
+        start = a->p;
+        n = name_len(start, a->end - start);
+        a->p += n;
+        if (a->p >= a->end || *a->p != '}') {
+            a->error = "bad variable reference";
+            return 0;
+        }
+        a->p++;
+    }
+    else {
+        start = a->p;
+        n = name_len(start, a->end - start);
+        a->p += n;
+    }
+    if (n == 0) {
+        a->error = "syntax error";
+        return 0;
+    }
+
+    start = lookup(start, n);
+    return start ? strtoll(start, NULL, 0) : 0;
+}
+
+// Precedence climbing over the binary operator table. Additive and
+// multiplicative operators wrap around like the hardware does
+static int64_t arith_binary(struct arith *a, int min_prec) {
+    int64_t lhs = arith_primary(a), rhs;
+    size_t i;
+
+    while (!a->error) {
+        arith_skip(a);
+        for (i = 0; i < sizeof(binops) / sizeof(binops[0]); i++) {
+            if (a->end - a->p >= binops[i].len &&
+                !strncmp(a->p, binops[i].op, binops[i].len))
+                break;
+        }
+        if (i == sizeof(binops) / sizeof(binops[0]) ||
+            binops[i].prec < min_prec)
+            break;
+
+        a->p += binops[i].len;
+        rhs = arith_binary(a, binops[i].prec + 1);
+        if (a->error) break;
+
+        switch (binops[i].op[0] | binops[i].op[1] << 8) {
+            case '|' | '|' << 8: lhs = lhs || rhs; break;
+            case '&' | '&' << 8: lhs = lhs && rhs; break;
+            case '=' | '=' << 8: lhs = lhs == rhs; break;
+            case '!' | '=' << 8: lhs = lhs != rhs; break;
+            case '<' | '=' << 8: lhs = lhs <= rhs; break;
+            case '>' | '=' << 8: lhs = lhs >= rhs; break;
+            case '<' | '<' << 8: lhs = (int64_t) ((uint64_t) lhs << (rhs & 63));
+                                 break;
+            case '>' | '>' << 8: lhs = lhs >> (rhs & 63); break;
+            case '|': lhs = lhs | rhs; break;
+            case '^': lhs = lhs ^ rhs; break;
+            case '&': lhs = lhs & rhs; break;
+            case '<': lhs = lhs < rhs; break;
+            case '>': lhs = lhs > rhs; break;
+            case '+': lhs = (int64_t) ((uint64_t) lhs + (uint64_t) rhs); break;
+            case '-': lhs = (int64_t) ((uint64_t) lhs - (uint64_t) rhs); break;
+            case '*': lhs = (int64_t) ((uint64_t) lhs * (uint64_t) rhs); break;
+            case '/':
+            case '%':
+                if (rhs == 0) {
+                    a->error = "division by zero";
+                    return 0;
+                }
+                if (rhs == -1)
+                    lhs = binops[i].op[0] == '/' ?
+                          (int64_t) (0 - (uint64_t) lhs) : 0;
+                else
+                    lhs = binops[i].op[0] == '/' ? lhs / rhs : lhs % rhs;
+                break;
+        }
+    }
+    return lhs;
+}
+
+static int64_t arith_ternary(struct arith *a) {
+    int64_t cond = arith_binary(a, 1), yes, no;
+
+    arith_skip(a);
+    if (a->error || a->p >= a->end || *a->p != '?')
+        return cond;
+
+    a->p++;
+    yes = arith_ternary(a);
+    arith_skip(a);
+    if (a->p >= a->end || *a->p != ':') {
+        if (!a->error) a->error = "missing ':'";
+        return 0;
+    }
+    a->p++;
+    no = arith_ternary(a);
+    return cond ? yes : no;
+}
+
+// Evaluates a 64 bit integer expression, as found inside $(( ))
+int eval_arith(const char *expr, size_t n, int64_t *result) {
+    struct arith a = { expr, expr + n, NULL };
+
+    *result = arith_ternary(&a);
+    arith_skip(&a);
+    if (!a.error && a.p < a.end) a.error = "syntax error";
+    if (a.error) {
+        expand_error(a.error, expr, n);
+        return EXPAND_ERROR;
+    }
+    return EXPAND_OK;
+}
+
+// Evaluates the body of $(( )) once its parameters and substitutions are
+// expanded, as POSIX has it. A body without any is evaluated in place
+static int expand_arith(const char *expr, size_t n, int64_t *value) {
+    struct strbuf sb = { NULL, 0, 0 };
+    int r;
+
+    if (!memchr(expr, '$', n) && !memchr(expr, '`', n))
+        return eval_arith(expr, n, value);
+
+    if ((r = expand_into(&sb, expr, n)) == EXPAND_OK) {
+        sb_reserve(&sb, 0);
+        sb.str[sb.len] = 0;
+        remove_quotes(sb.str);
+        r = eval_arith(sb.str, strlen(sb.str), value);
+    }
+    free(sb.str);
+    return r;
+}
+
+// Expands the operand of ${v#word} and the like with its quoting
+// honoured. In a pattern the characters quoting made literal end up
+// escaped, elsewhere the quotes are just dropped. An operand with nothing
+// to expand or unquote is used in place, tmp holds any other
+static int expand_operand(const char *str, size_t n, int pattern,
+                          struct strbuf *tmp, const char **out, size_t *len) {
+    char *word, *marked;
+    size_t i;
+    int r;
+
+    for (i = 0; i < n && !strchr("'\"\\$`\001\002", str[i]); i++);
+    if (i == n) {
+        *out = str;
+        *len = n;
+        return EXPAND_OK;
+    }
+
+    word = strndup(str, n);
+    marked = (char *) malloc(2 * n + 1);
+    mark_quotes(word, marked);
+    r = expand_into(tmp, marked, strlen(marked));
+    free(word);
+    free(marked);
+    if (r != EXPAND_OK)
+        return EXPAND_ERROR;
+
+    sb_reserve(tmp, 0);
+    tmp->str[tmp->len] = 0;
+    if (pattern) {
+        for (i = 0; i < tmp->len; i++) {
+            if (tmp->str[i] == QUOTE_MARK && i + 1 < tmp->len)
+                tmp->str[i++] = '\\';
+        }
+    } else {
+        remove_quotes(tmp->str);
+        tmp->len = strlen(tmp->str);
+    }
+    *out = tmp->str;
+    *len = tmp->len;
+    return EXPAND_OK;
+}
+
+// Expands the body of ${...}: plain, ${#v}, ${v#p}, ${v##p}, ${v%p},
+// ${v%%p}, ${v:-d}, ${v/x/y} and ${v//x/y}
+static int expand_param(struct strbuf *sb, const char *body, size_t n) {
+    struct strbuf pat_buf = { NULL, 0, 0 }, rep_buf = { NULL, 0, 0 };
+    struct pat_elem elem_buf[PAT_STACK + 1], *elems;
+    size_t state_buf[2 * (PAT_STACK + 2)], *states;
+    const char *value, *op, *pat, *rep, *end;
+    size_t nl, vn, on, pn, rn, i, len, ne;
+    ssize_t start;
+    int longest, r = EXPAND_OK;
+
+    // Length of a variable
+    if (n > 1 && body[0] == '#') {
+        nl = name_len(&body[1], n - 1);
+        if (nl != n - 1) {
+            expand_error("bad substitution", body, n);
+            return EXPAND_ERROR;
+        }
+        value = lookup(&body[1], nl);
+        sb_putnum(sb, value ? (int64_t) strlen(value) : 0);
+        return EXPAND_OK;
+    }
+
+    nl = name_len(body, n);
+    if (nl == 0) {
+        expand_error("bad substitution", body, n);
+        return EXPAND_ERROR;
+    }
+    value = lookup(body, nl);
+    vn = value ? strlen(value) : 0;
+    op = &body[nl];
+    on = n - nl;
+    end = &op[on];
+
+    if (on == 0) {
+        sb_putn(sb, value, vn);
+        return EXPAND_OK;
+    }
+
+    // Default value, which may itself contain expansions
+    if (on >= 2 && op[0] == ':' && op[1] == '-') {
+        if (vn > 0) {
+            sb_putn(sb, value, vn);
+        } else if ((r = expand_operand(&op[2], on - 2, 0, &rep_buf, &rep,
+                                       &rn)) == EXPAND_OK) {
+            sb_putn(sb, rep, rn);
+        }
+        free(rep_buf.str);
+        return r;
+    }
+
+    // Prefix removal, shortest or longest match
+    if (op[0] == '#') {
+        longest = on > 1 && op[1] == '#';
+        if (expand_operand(&op[1 + longest], on - 1 - longest, 1, &pat_buf,
+                           &pat, &pn) != EXPAND_OK) {
+            free(pat_buf.str);
+            return EXPAND_ERROR;
+        }
+        len = 0;
+        for (i = 0; i <= vn; i++) {
+            size_t cut = longest ? vn - i : i;
+
+            if (match_pattern(pat, pn, value, cut)) {
+                len = cut;
+                break;
+            }
+        }
+        sb_putn(sb, value + len, vn - len);
+        free(pat_buf.str);
+        return EXPAND_OK;
+    }
+
+    // Suffix removal, shortest or longest match
+    if (op[0] == '%') {
+        longest = on > 1 && op[1] == '%';
+        if (expand_operand(&op[1 + longest], on - 1 - longest, 1, &pat_buf,
+                           &pat, &pn) != EXPAND_OK) {
+            free(pat_buf.str);
+            return EXPAND_ERROR;
+        }
+        len = vn;
+        for (i = 0; i <= vn; i++) {
+            size_t start = longest ? i : vn - i;
+
+            if (match_pattern(pat, pn, value + start, vn - start)) {
+                len = start;
+                break;
+            }
+        }
+        sb_putn(sb, value, len);
+        free(pat_buf.str);
+        return EXPAND_OK;
+    }
+
+    // Replacement of the first (or every) longest match. The pattern ends
+    // at the first '/' neither escaped nor quoted
+    if (op[0] == '/') {
+        longest = on > 1 && op[1] == '/';
+        pat = &op[1 + longest];
+        for (pn = 0; &pat[pn] < end && pat[pn] != '/'; pn++) {
+            if (pat[pn] == '\\' && &pat[pn + 1] < end) {
+                pn++;
+            } else if (pat[pn] == '\'' || pat[pn] == '"') {
+                for (i = pn + 1; &pat[i] < end && pat[i] != pat[pn]; i++);
+                if (&pat[i] < end) pn = i;
+            }
+        }
+        rep = &pat[pn] < end ? &pat[pn + 1] : end;
+        if (expand_operand(pat, pn, 1, &pat_buf, &pat, &pn) != EXPAND_OK ||
+            expand_operand(rep, end - rep, 0, &rep_buf, &rep, &rn) !=
+                EXPAND_OK) {
+            free(pat_buf.str);
+            free(rep_buf.str);
+            return EXPAND_ERROR;
+        }
+
+        // Only long patterns need the heap
+        elems = pn <= PAT_STACK ? elem_buf : (struct pat_elem *)
+                malloc((pn + 1) * sizeof(*elems));
+        states = pn <= PAT_STACK ? state_buf : (size_t *)
+                 malloc(2 * (pn + 2) * sizeof(size_t));
+        ne = pattern_elems(pat, pn, elems);
+
+        i = 0;
+        while (pn > 0 && i < vn &&
+               (start = find_match(pat, elems, ne, value, i, vn, &len,
+                                   states, states + pn + 2)) >= 0) {
+            sb_putn(sb, value + i, start - i);
+            sb_putn(sb, rep, rn);
+            i = len;
+            if (!longest) break;
+        }
+        sb_putn(sb, value + i, vn - i);
+        if (elems != elem_buf) {
+            free(elems);
+            free(states);
+        }
+        free(pat_buf.str);
+        free(rep_buf.str);
+        return EXPAND_OK;
+    }
+
+    expand_error("bad substitution", body, n);
+    return EXPAND_ERROR;
+}
+
+// Marks the characters of sb[from..) that are in specials, so the
+// result of an expansion is not taken for quoting or wildcards
+static void protect_result(struct strbuf *sb, size_t from,
+                           const char *specials) {
+    size_t r, w, n = 0;
+    char c;
+
+    for (r = from; r < sb->len; r++)
+        if (sb->str[r] && strchr(specials, sb->str[r])) n++;
+    if (n == 0) return;
+
+    // Moved up from the end, marks going in front of their character
+    sb_reserve(sb, n);
+    r = sb->len;
+    w = sb->len + n;
+    sb->str[w] = 0;
+    while (r > from) {
+        c = sb->str[--r];
+        sb->str[--w] = c;
+        if (c && strchr(specials, c)) sb->str[--w] = QUOTE_MARK;
+    }
+    sb->len += n;
+}
+
+// Appends the expansion of str[0..n) to sb. Characters quoting made
+// literal are copied with their mark, and the result of an expansion
+// between double quotes has its wildcards marked too
+static int expand_into(struct strbuf *sb, const char *str, size_t n) {
+    size_t i = 0, lit = 0, end, nl, from;
+    int64_t value;
+    const char *var;
+    int quoted = 0;
+
+    while (i < n) {
+        if (str[i] == QUOTE_MARK) {
+            i += 2;
+            quoted = 0;
+            continue;
+        }
+        if (str[i] == DQUOTE_MARK) {
+            sb_putn(sb, &str[lit], i - lit);
+            lit = ++i;
+            quoted = 1;
+            continue;
+        }
+        from = sb->len;
+
+        // Backtick command substitution
+        if (str[i] == '`') {
+            sb_putn(sb, &str[lit], i - lit);
+            from = sb->len;
+            for (end = i + 1; end < n && str[end] != '`'; end++);
+            if (end == n) {
+                expand_error("missing '`'", &str[i], n - i);
+                return EXPAND_ERROR;
+            }
+            if (run_substitution(sb, &str[i + 1], end - i - 1) != EXPAND_OK)
+                return EXPAND_ERROR;
+            protect_result(sb, from, quoted ? QUOTED_GLOBS : QUOTE_MARKS);
+            lit = i = end + 1;
+            quoted = 0;
+            continue;
+        }
+        if (str[i] != '$' || i + 1 >= n) {
+            i++;
+            quoted = 0;
+            continue;
+        }
+        sb_putn(sb, &str[lit], i - lit);
+        from = sb->len;
+
+        // Arithmetic expansion $(( ))
+        if (str[i + 1] == '(' && i + 2 < n && str[i + 2] == '(' &&
+            (end = group_end(str, n, i + 1)) < n && str[end - 1] == ')' &&
+            group_end(str, n, i + 2) == end - 1) {
+            if (expand_arith(&str[i + 3], end - i - 4, &value) != EXPAND_OK)
+                return EXPAND_ERROR;
+            sb_putnum(sb, value);
+            i = end + 1;
+        }
+        // Command substitution $( )
+        else if (str[i + 1] == '(') {
+            if ((end = group_end(str, n, i + 1)) == n) {
+                expand_error("missing ')'", &str[i], n - i);
+                return EXPAND_ERROR;
+            }
+            if (run_substitution(sb, &str[i + 2], end - i - 2) != EXPAND_OK)
+                return EXPAND_ERROR;
+            i = end + 1;
+        }
+        // Parameter expansion ${ }
+        else if (str[i + 1] == '{') {
+            if ((end = group_end(str, n, i + 1)) == n) {
+                expand_error("missing '}'", &str[i], n - i);
+                return EXPAND_ERROR;
+            }
+            if (expand_param(sb, &str[i + 2], end - i - 2) != EXPAND_OK)
+                return EXPAND_ERROR;
+            i = end + 1;
+        }
+        // Shell pid
+        else if (str[i + 1] == '$') {
+            sb_putnum(sb, getpid());
+            i += 2;
+        }
+        // Status of the last command
+        else if (str[i + 1] == '?') {
+            sb_putnum(sb, last_status);
+            i += 2;
+        }
+        // Pid of the last background job
+        else if (str[i + 1] == '!') {
+            if (last_bg_pid > 0) sb_putnum(sb, last_bg_pid);
+            i += 2;
+        }
+        // Plain $name
+        else if ((nl = name_len(&str[i + 1], n - i - 1)) > 0) {
+            var = lookup(&str[i + 1], nl);
+            if (var) sb_putn(sb, var, strlen(var));
+            i += nl + 1;
+        }
+        // Not an expansion, keep the '$'
+        else {
+            lit = i++;
+            quoted = 0;
+            continue;
+        }
+        protect_result(sb, from, quoted ? QUOTED_GLOBS : QUOTE_MARKS);
+        lit = i;
+        quoted = 0;
+    }
+    sb_putn(sb, &str[lit], n - lit);
+    return EXPAND_OK;
+}
+
+// Expands a single word. *result is left NULL when the word has nothing
+// to expand, so plain words never allocate
+int expand_word(const char *word, char **result) {
+    struct strbuf sb = { NULL, 0, 0 };
+
+    *result = NULL;
+    if (!strpbrk(word, "$`"))
+        return EXPAND_OK;
+
+    if (expand_into(&sb, word, strlen(word)) != EXPAND_OK) {
+        free(sb.str);
+        return EXPAND_ERROR;
+    }
+
+    // Give back the slack left by geometric growth on large substitutions
+    if (sb.cap - sb.len > 4096)
+        sb.str = (char *) realloc(sb.str, sb.len + 1);
+    *result = sb.str;
+    return EXPAND_OK;
+}
+
+// The word as a pattern: characters quoting made literal are escaped
+static char *glob_pattern(const char *word) {
+    char *pattern = (char *) malloc(2 * strlen(word) + 1), *w = pattern;
+
+    for (; *word; word++) {
+        if (*word == QUOTE_MARK && word[1]) {
+            *w++ = '\\';
+            word++;
+        }
+        *w++ = *word;
+    }
+    *w = 0;
+    return pattern;
+}
+
+// Expands every argument of the command in place, then removes the
+// quotes. A word with wildcards is replaced by the matching paths, or
+// kept as is when none match
+int expand_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd), **matches;
+    char *expanded, *pattern;
+    int i, j, n;
+
+    for (i = 0; args && args[i]; i++) {
+        // Process substitutions are expanded by their own subshell, and
+        // the other operators are left to the launch
+        if (is_operator(args[i]))
+            continue;
+        if (expand_word(args[i], &expanded) != EXPAND_OK)
+            return INVALID;
+        if (expanded) {
+            free(args[i]);
+            args[i] = expanded;
+        }
+
+        n = 0;
+        if (strpbrk(args[i], "*?[")) {
+            pattern = glob_pattern(args[i]);
+            if (has_wildcards(pattern)) {
+                n = expand_wildcards(pattern, shell_options & OPT_GLOBSTAR ?
+                                     WC_GLOBSTAR : 0, &matches);
+                if (n > 0) {
+                    for (j = 0; j < n; j++) {
+                        if (is_operator(matches[j]))
+                            matches[j] = mark_operator(matches[j]);
+                    }
+                    splice_cmd_args(cmd, i, matches, n);
+                    args = get_cmd_args(cmd);
+                    i += n - 1;
+                }
+                free(matches);
+            }
+            free(pattern);
+        }
+        if (n == 0) {
+            remove_quotes(args[i]);
+
+            // Quoted or expanded, it is only a word
+            if (is_operator(args[i]))
+                args[i] = mark_operator(args[i]);
+        }
+    }
+    return VALID;
+}
@@ -0,0 +1,38 @@
+#ifndef EXPAND_H
+#define EXPAND_H
+
+    #include <stddef.h>
+    #include <stdint.h>
+    #include "parser.h"
+
+    #define EXPAND_OK    0
+    #define EXPAND_ERROR -1
+
+    // Shell options, toggled with set -o/+o
+    #define OPT_GLOBSTAR 0x1
+    #define OPT_CAPTURE  0x2   // background jobs behave as with &!
+
+    extern int shell_options;
+
+    // $? and $!, maintained by the shell
+    extern int last_status;
+    extern int last_bg_pid;
+
+    // Growable output string, the only allocation made by an expansion
+    struct strbuf {
+        char   *str;
+        size_t len;
+        size_t cap;
+    };
+
+    int  expand_word(const char *, char **);
+    int  expand_cmd(Command);
+    int  eval_arith(const char *, size_t, int64_t *);
+    int  match_pattern(const char *, size_t, const char *, size_t);
+    void sb_putn(struct strbuf *, const char *, size_t);
+    void sb_reserve(struct strbuf *, size_t);
+
+    // Command substitution, provided by the shell
+    int  run_substitution(struct strbuf *, const char *, size_t);
+
+#endif
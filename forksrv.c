@@ -0,0 +1,444 @@
+#define _GNU_SOURCE
+#include "forksrv.h"
+#include "color.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// Launch request header, followed by the cwd, argv and environment
+// strings, each NUL terminated. The job's stdin, stdout and stderr
+// travel with it as SCM_RIGHTS
+struct forksrv_req {
+    int32_t foreground;
+    int32_t interactive;
+    int32_t argc;
+    int32_t envc;
+    struct job_limits limits;
+};
+
+extern char **environ;
+
+static int   srv_sock = -1;
+static pid_t srv_pid = -1;
+
+// Sends one message with descriptors attached
+ssize_t send_with_fds(int sock, struct iovec *iov, int niov, int *fds,
+                      int nfds) {
+    char control[CMSG_SPACE(FORKSRV_FDS * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = niov;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    do {
+        n = sendmsg(sock, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Receives one request. Descriptors arrive close-on-exec, only the ones
+// dup'ed onto 0, 1 and 2 reach the job
+ssize_t recv_with_fds(int sock, char *buf, size_t len, int *fds, int *nfds) {
+    char control[CMSG_SPACE(FORKSRV_FDS * sizeof(int))];
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+
+    *nfds = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); n > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+        }
+    }
+    return n;
+}
+
+// Splits count NUL terminated strings out of [*p, end) into v
+static int unpack_strings(char **p, char *end, char **v, int count) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        char *nul = (char *) memchr(*p, 0, end - *p);
+
+        if (!nul) return -1;
+        v[i] = *p;
+        *p = nul + 1;
+    }
+    v[count] = NULL;
+    return 0;
+}
+
+// What the job's child needs, all allocated before the clone. The raw
+// clone gives the child a copy of the server's memory, but without the
+// reset of glibc's locks and cached state fork() would do, so it must
+// only make system calls
+struct launch {
+    Command              cmd;          // Without its redirections and '&'
+    struct redirection_t *redirs[4];
+    int                  nredirs;
+    char                 **paths;      // Where execvp() would look
+    char                 **sh_argv;    // /bin/sh, path, args, for ENOEXEC
+    char                 not_found[1024];
+    int                  no_color;     // NO_COLOR is set in the job's env
+};
+
+static const struct {
+    const char *op;
+    int        type;
+} redirections[] = {
+    {">", ROUT}, {">>", ROUT_APPEND}, {"<", RIN}, {"2>", RERR}
+};
+
+// The places execvp() would try for file, in order
+static char **exec_paths(const char *file, char **envp) {
+    const char *path = "/bin:/usr/bin", *dir, *end;
+    char **paths;
+    size_t n = 2, len = strlen(file), dlen;
+
+    for (; *envp; envp++) {
+        if (!strncmp(*envp, "PATH=", 5))
+            path = *envp + 5;
+    }
+    if (strchr(file, '/') || !*file)
+        path = "";
+    for (dir = path; (dir = strchr(dir, ':')); dir++)
+        n++;
+
+    paths = (char **) malloc(n * sizeof(char *));
+    n = 0;
+    if (strchr(file, '/')) {
+        paths[n++] = strdup(file);
+    }
+    else if (*file) {
+        for (dir = path;; dir = end + 1) {
+            end = strchrnul(dir, ':');
+            // An empty entry is the current directory
+            dlen = end - dir;
+            paths[n] = (char *) malloc(dlen + len + 3);
+            if (dlen) memcpy(paths[n], dir, dlen);
+            else paths[n][dlen++] = '.';
+            paths[n][dlen] = '/';
+            memcpy(&paths[n][dlen + 1], file, len + 1);
+            n++;
+            if (!*end) break;
+        }
+    }
+    paths[n] = NULL;
+    return paths;
+}
+
+// Does in the server what exec_job() does in a child of the shell
+static void prepare_launch(struct launch *l, char **argv, char **envp,
+                           int foreground) {
+    char **args;
+    size_t len;
+    int i;
+
+    l->cmd = new_command();
+    for (i = 0; argv[i]; i++)
+        push_arg(l->cmd, strdup(argv[i]));
+    if (!foreground && !is_foreground(l->cmd))
+        splice_cmd_args(l->cmd, get_cmd_argc(l->cmd) - 1, NULL, 0);
+
+    l->nredirs = 0;
+    for (i = 0; i < 4; i++) {
+        if ((l->redirs[l->nredirs] = extract_redirection(
+                 l->cmd, redirections[i].op, redirections[i].type)))
+            l->nredirs++;
+    }
+    unmark_operators(l->cmd);
+
+    l->no_color = 0;
+    for (i = 0; envp[i]; i++) {
+        if (!strncmp(envp[i], "NO_COLOR=", 9) && envp[i][9])
+            l->no_color = 1;
+    }
+
+    args = get_cmd_args(l->cmd);
+    l->paths = exec_paths(args ? args[0] : "", envp);
+    l->sh_argv = (char **) malloc((get_cmd_argc(l->cmd) + 2) *
+                                  sizeof(char *));
+    l->sh_argv[0] = "/bin/sh";
+    for (i = 0; args && args[i]; i++)
+        l->sh_argv[i + 1] = args[i];
+    l->sh_argv[i + 1] = NULL;
+
+    // Same words as print_cmd(), the error code is added by the child
+    len = snprintf(l->not_found, sizeof(l->not_found), "ERROR: Command %s (",
+                   args ? args[0] : "");
+    for (i = 1; args && args[i] && len < sizeof(l->not_found); i++)
+        len += snprintf(&l->not_found[len], sizeof(l->not_found) - len,
+                        "%s%s", args[i], args[i + 1] ? ", " : "");
+    if (len < sizeof(l->not_found))
+        snprintf(&l->not_found[len], sizeof(l->not_found) - len,
+                 ") not found (error code ");
+}
+
+static void free_launch(struct launch *l) {
+    int i;
+
+    free_cmd(&l->cmd);
+    for (i = 0; i < l->nredirs; i++)
+        free_redirection(l->redirs[i]);
+    for (i = 0; l->paths[i]; i++)
+        free(l->paths[i]);
+    free(l->paths);
+    free(l->sh_argv);
+}
+
+// Writes the message, the error code and the end of the line, in the
+// shell's error colour on a terminal, then leaves
+static void child_fail(const struct launch *l, const char *msg, int err) {
+    int color = !l->no_color && isatty(STDOUT_FILENO);
+    char num[16];
+    int n = sizeof(num);
+
+    do {
+        num[--n] = '0' + err % 10;
+        err /= 10;
+    } while (err && n > 0);
+
+    if (color)
+        write(STDOUT_FILENO, RED, strlen(RED));
+    write(STDOUT_FILENO, msg, strlen(msg));
+    write(STDOUT_FILENO, &num[n], sizeof(num) - n);
+    write(STDOUT_FILENO, ")\n", 2);
+    if (color)
+        write(STDOUT_FILENO, NONE, strlen(NONE));
+    _exit(1);
+}
+
+// The job's side of the clone. System calls only, see struct launch
+static void launch_child(struct forksrv_req *req, const char *cwd, int *fds,
+                         char **envp, struct launch *l) {
+    int i, fd, err = ENOENT, denied = 0;
+
+    // Same process group and terminal setup as launch_job()
+    setpgid(0, 0);
+    if (req->foreground && req->interactive)
+        tcsetpgrp(STDIN_FILENO, getpid());
+
+    if (chdir(cwd) == -1)
+        _exit(1);
+    for (i = 0; i < FORKSRV_FDS; i++)
+        dup2(fds[i], i);
+    if (apply_limits(&req->limits) == -1)
+        child_fail(l, "ERROR: unable to set the limits (error code ", errno);
+
+    for (i = 0; i < l->nredirs; i++) {
+        struct redirection_t *r = l->redirs[i];
+        int flags = r->type == RIN ? O_RDONLY :
+                    O_RDWR | O_CREAT | (r->type == ROUT_APPEND ? O_APPEND
+                                                                : O_TRUNC);
+
+        if ((fd = open(r->file, flags, 0666)) >= 0) {
+            dup2(fd, r->type == RIN ? STDIN_FILENO :
+                     r->type == RERR ? STDERR_FILENO : STDOUT_FILENO);
+            close(fd);
+        }
+    }
+
+    // execvp(), without its allocations: the first path that runs wins,
+    // EACCES is kept over ENOENT, anything else ends the search
+    for (i = 0; l->paths[i]; i++) {
+        execve(l->paths[i], &l->sh_argv[1], envp);
+        if (errno == ENOEXEC) {
+            l->sh_argv[1] = l->paths[i];
+            execve("/bin/sh", l->sh_argv, envp);
+        }
+        err = errno;
+        if (err == EACCES)
+            denied = 1;
+        else if (err != ENOENT && err != ENOTDIR && err != ESTALE)
+            break;
+    }
+    if (denied && (err == ENOENT || err == ENOTDIR || err == ESTALE))
+        err = EACCES;
+
+    METRIC_INC(exec_failures);
+    child_fail(l, l->not_found, err);
+}
+
+// Starts the job described by a request. The clone uses CLONE_PARENT, so
+// the job is a child of the shell: the shell waits for it, signals it
+// and gets its SIGCHLD exactly as if it had forked it itself
+static int32_t spawn_request(char *buf, size_t n, int *fds) {
+    struct forksrv_req *req = (struct forksrv_req *) buf;
+    char *p = buf + sizeof(*req), *cwd[2], **argv, **envp;
+    struct launch l;
+    pid_t pid;
+
+    if (n < sizeof(*req) || req->argc < 1 || req->envc < 0 ||
+        req->argc > FORKSRV_MAX_MSG || req->envc > FORKSRV_MAX_MSG)
+        return -EINVAL;
+
+    argv = (char **) malloc((req->argc + 1) * sizeof(char *));
+    envp = (char **) malloc((req->envc + 1) * sizeof(char *));
+    if (unpack_strings(&p, buf + n, cwd, 1) ||
+        unpack_strings(&p, buf + n, argv, req->argc) ||
+        unpack_strings(&p, buf + n, envp, req->envc)) {
+        free(argv);
+        free(envp);
+        return -EINVAL;
+    }
+    prepare_launch(&l, argv, envp, req->foreground);
+
+    pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0)
+        launch_child(req, cwd[0], fds, envp, &l);
+    if (pid < 0)
+        pid = -errno;
+
+    free_launch(&l);
+    free(argv);
+    free(envp);
+    return pid;
+}
+
+static void serve() {
+    char *buf = (char *) malloc(FORKSRV_MAX_MSG);
+    int fds[FORKSRV_FDS], nfds, i;
+    int32_t reply;
+    ssize_t n;
+
+    // Keyboard signals are for the jobs, never for the server
+    setpgid(0, 0);
+
+    while ((n = recv_with_fds(srv_sock, buf, FORKSRV_MAX_MSG, fds,
+                              &nfds)) > 0) {
+        reply = nfds == FORKSRV_FDS ? spawn_request(buf, n, fds) : -EINVAL;
+        for (i = 0; i < nfds; i++)
+            close(fds[i]);
+        send(srv_sock, &reply, sizeof(reply), 0);
+    }
+
+    // The shell is gone
+    _exit(0);
+}
+
+// Forks the server while the shell is still small: every later launch
+// then costs a fork of this address space, whatever the shell grows to
+int forksrv_start() {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        return -1;
+
+    term_flush();
+    if ((srv_pid = fork()) == 0) {
+        close(sv[0]);
+        srv_sock = sv[1];
+        serve();
+    }
+    close(sv[1]);
+
+    if (srv_pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    srv_sock = sv[0];
+    return 0;
+}
+
+int forksrv_running() {
+    return srv_sock >= 0;
+}
+
+void forksrv_stop() {
+    if (srv_sock >= 0) {
+        close(srv_sock);
+        srv_sock = -1;
+    }
+}
+
+// Appends a NUL terminated string to a request body, if it still fits
+static int pack(char *blob, size_t *len, const char *str) {
+    size_t n = strlen(str) + 1;
+
+    if (sizeof(struct forksrv_req) + *len + n > FORKSRV_MAX_MSG)
+        return 0;
+    memcpy(&blob[*len], str, n);
+    *len += n;
+    return 1;
+}
+
+// Asks the server to launch the command. Returns the job's pid, or -1
+// when the request cannot go through the server and the caller must fork
+pid_t forksrv_spawn(Command cmd, int foreground, int interactive, int in,
+                    int out, int err, const struct job_limits *limits) {
+    struct forksrv_req req;
+    struct iovec iov[2];
+    char cwd[PATH_MAX], *blob, **args = get_cmd_args(cmd), **env;
+    size_t len = 0;
+    int fits, fds[FORKSRV_FDS] = { in, out, err };
+    int32_t reply;
+
+    if (srv_sock < 0 || !getcwd(cwd, sizeof(cwd)))
+        return -1;
+
+    req.foreground = foreground;
+    req.interactive = interactive;
+    req.argc = get_cmd_argc(cmd);
+    req.envc = 0;
+    req.limits = *limits;
+
+    blob = (char *) malloc(FORKSRV_MAX_MSG);
+    fits = pack(blob, &len, cwd);
+    for (; fits && *args; args++)
+        fits = pack(blob, &len, *args);
+    for (env = environ; fits && *env; env++, req.envc++)
+        fits = pack(blob, &len, *env);
+    if (!fits) {
+        free(blob);
+        return -1;
+    }
+
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = blob;
+    iov[1].iov_len = len;
+
+    if (send_with_fds(srv_sock, iov, 2, fds, FORKSRV_FDS) < 0 ||
+        recv(srv_sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        // The server died, launch everything from the shell from now on
+        forksrv_stop();
+        reply = -1;
+    }
+    free(blob);
+    return reply > 0 ? reply : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef FORKSRV_H
+#define FORKSRV_H
+
+    #include <sys/types.h>
+    #include <sys/uio.h>
+    #include "parser.h"
+    #include "rlimits.h"
+
+    // Largest launch request; anything bigger is forked by the shell
+    #define FORKSRV_MAX_MSG 65536
+
+    // Descriptors passed with a request: stdin, stdout and stderr
+    #define FORKSRV_FDS 3
+
+    int   forksrv_start();
+    int   forksrv_running();
+    pid_t forksrv_spawn(Command, int, int, int, int, int,
+                        const struct job_limits *);
+    void  forksrv_stop();
+
+    // SCM_RIGHTS framing, also used by the --serve mode
+    ssize_t send_with_fds(int, struct iovec *, int, int *, int);
+    ssize_t recv_with_fds(int, char *, size_t, int *, int *);
+
+#endif
@@ -0,0 +1,151 @@
+#include "input.h"
+#include "capture.h"
+#include "lineedit.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MAX_READERS 64
+
+// Reader used for fd 0: the shell's own input, or the pipe feeding a
+// builtin that ends a pipeline
+Reader stdin_reader = NULL;
+
+// Readers for other descriptors, kept so read-ahead survives between calls
+static Reader readers[MAX_READERS];
+static dev_t  reader_dev[MAX_READERS];
+static ino_t  reader_ino[MAX_READERS];
+
+Reader open_reader(int fd, int mode) {
+    Reader r = (Reader) calloc(1, sizeof(struct reader));
+    struct stat st;
+
+    // A regular file can always be read ahead and rewound
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        mode = RD_SEEKABLE;
+        r->pos = lseek(fd, 0, SEEK_CUR);
+    }
+
+    r->fd = fd;
+    r->mode = mode;
+    r->buf = (char *) malloc(mode == RD_BYTE ? 1 : RD_BLOCK_SIZE);
+    return r;
+}
+
+// Returns the cached reader for fd, replacing it when the descriptor now
+// refers to another file
+Reader reader_for(int fd) {
+    struct stat st;
+
+    if (fd == 0 && stdin_reader)
+        return stdin_reader;
+    if (fd < 0 || fd >= MAX_READERS || fstat(fd, &st) == -1)
+        return NULL;
+
+    if (readers[fd] &&
+        (reader_dev[fd] != st.st_dev || reader_ino[fd] != st.st_ino)) {
+        close_reader(readers[fd]);
+        readers[fd] = NULL;
+    }
+    if (!readers[fd]) {
+        readers[fd] = open_reader(fd, RD_BYTE);
+        reader_dev[fd] = st.st_dev;
+        reader_ino[fd] = st.st_ino;
+    }
+    return readers[fd];
+}
+
+void close_reader(Reader r) {
+    if (r) {
+        free(r->buf);
+        free(r);
+    }
+}
+
+// Refills an empty buffer. Regular files are read with pread, so the
+// shared offset only moves when a record is published
+static int fill(Reader r) {
+    size_t size = r->mode == RD_BYTE ? 1 : RD_BLOCK_SIZE;
+    ssize_t n;
+
+    if (r->eof)
+        return 0;
+
+    // Output is written before blocking, captured jobs are drained and
+    // deadlines enforced while the shell waits for input. A Ctrl-C or
+    // Ctrl-Z interrupts the wait to draw a new prompt
+    if (r->mode != RD_SEEKABLE)
+        term_flush();
+    if (r->mode != RD_SEEKABLE)
+        while (event_loop_active() && capture_wait(r->fd) != CW_READY)
+            redraw_prompt();
+
+    while ((n = r->mode == RD_SEEKABLE ? pread(r->fd, r->buf, size, r->pos)
+                                       : read(r->fd, r->buf, size)) < 0 &&
+           errno == EINTR)
+        redraw_prompt();
+
+    if (n <= 0) {
+        r->eof = 1;
+        return 0;
+    }
+    r->start = 0;
+    r->end = n;
+    return 1;
+}
+
+// Starts a record. If another process moved the shared offset of a
+// regular file since the last record, the read-ahead is stale
+void reader_begin(Reader r) {
+    off_t cur;
+
+    if (r->mode != RD_SEEKABLE)
+        return;
+
+    cur = lseek(r->fd, 0, SEEK_CUR);
+    if (cur != r->pos) {
+        r->start = r->end = 0;
+        r->pos = cur;
+    }
+    r->eof = 0;
+}
+
+// Ends a record, leaving a regular file's offset right after it so
+// children inheriting the descriptor carry on from there
+void reader_publish(Reader r) {
+    if (r->mode == RD_SEEKABLE)
+        lseek(r->fd, r->pos, SEEK_SET);
+}
+
+int reader_getc(Reader r) {
+    if (r->start == r->end && !fill(r))
+        return EOF;
+    r->pos++;
+    return (unsigned char) r->buf[r->start++];
+}
+
+// Appends the next record, delimiter included, to the buffer. Returns
+// the number of bytes consumed, 0 at end of input
+ssize_t reader_getdelim(Reader r, struct strbuf *sb, int delim) {
+    ssize_t total = 0;
+
+    reader_begin(r);
+    while (r->start < r->end || fill(r)) {
+        char *hit = (char *) memchr(&r->buf[r->start], delim,
+                                    r->end - r->start);
+        size_t n = hit ? (size_t) (hit - &r->buf[r->start]) + 1
+                       : r->end - r->start;
+
+        sb_putn(sb, &r->buf[r->start], n);
+        r->start += n;
+        r->pos += n;
+        total += n;
+        if (hit) break;
+    }
+    reader_publish(r);
+    return total;
+}
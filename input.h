@@ -0,0 +1,36 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+    #include <sys/types.h>
+    #include "expand.h"
+
+    // Reader modes
+    #define RD_BYTE      0   // shared stream, never read past a record
+    #define RD_SEEKABLE  1   // regular file, offset published per record
+    #define RD_BUFFERED  2   // stream owned by the shell, block reads
+
+    #define RD_BLOCK_SIZE 65536
+
+    typedef struct reader *Reader;
+
+    struct reader {
+        int   fd;
+        int   mode;
+        char  *buf;
+        size_t start;
+        size_t end;
+        off_t pos;
+        int   eof;
+    };
+
+    extern Reader stdin_reader;
+
+    Reader open_reader(int, int);
+    Reader reader_for(int);
+    void   close_reader(Reader);
+    int    reader_getc(Reader);
+    ssize_t reader_getdelim(Reader, struct strbuf *, int);
+    void   reader_begin(Reader);
+    void   reader_publish(Reader);
+
+#endif
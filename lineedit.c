@@ -0,0 +1,335 @@
+#include "lineedit.h"
+#include "complete.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#define ESC     27
+#define DEL     127
+// Keys with no control character of their own
+#define KEY_DELETE 256
+
+// Most candidates listed on a double tab
+#define MAX_LISTED 200
+
+static char *history[EDIT_HISTORY];
+static int  nhistory = 0;
+
+// The line being edited, shown after a prompt_width wide prompt and
+// scrolled sideways when longer than the terminal
+struct edit {
+    struct strbuf buf;
+    size_t pos;
+    size_t scroll;
+    int    prompt_width;
+    int    fd;
+};
+
+static int columns(int fd) {
+    struct winsize ws;
+
+    return ioctl(fd, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+}
+
+// Redraws the line in one frame: back to the start of the input, the
+// visible part of the line, clear the rest, cursor in place
+static void refresh(struct edit *e) {
+    size_t avail = columns(e->fd) - e->prompt_width - 1, shown;
+
+    if ((int) avail < 1)
+        avail = 1;
+    if (e->pos < e->scroll)
+        e->scroll = e->pos;
+    if (e->pos - e->scroll > avail)
+        e->scroll = e->pos - avail;
+    shown = e->buf.len - e->scroll < avail ? e->buf.len - e->scroll : avail;
+
+    term_write("\r", 1);
+    if (e->prompt_width)
+        term_printf("\033[%dC", e->prompt_width);
+    term_write(e->buf.str + e->scroll, shown);
+    term_write("\033[K\r", 4);
+    if (e->prompt_width + e->pos - e->scroll > 0)
+        term_printf("\033[%dC", (int) (e->prompt_width + e->pos - e->scroll));
+    term_flush();
+}
+
+static void insert(struct edit *e, const char *str, size_t n) {
+    sb_reserve(&e->buf, n);
+    memmove(e->buf.str + e->pos + n, e->buf.str + e->pos,
+            e->buf.len - e->pos + 1);
+    memcpy(e->buf.str + e->pos, str, n);
+    e->buf.len += n;
+    e->pos += n;
+}
+
+// Removes [from, to) and keeps the cursor on the same text
+static void delete(struct edit *e, size_t from, size_t to) {
+    memmove(e->buf.str + from, e->buf.str + to, e->buf.len - to + 1);
+    e->buf.len -= to - from;
+    if (e->pos >= to)
+        e->pos -= to - from;
+    else if (e->pos > from)
+        e->pos = from;
+}
+
+static void replace(struct edit *e, const char *str) {
+    e->buf.len = 0;
+    e->buf.str[0] = 0;
+    e->pos = 0;
+    insert(e, str, strlen(str));
+}
+
+static void history_add(const char *line) {
+    if (!*line || (nhistory && !strcmp(history[nhistory - 1], line)))
+        return;
+    if (nhistory == EDIT_HISTORY) {
+        free(history[0]);
+        memmove(&history[0], &history[1], --nhistory * sizeof(char *));
+    }
+    history[nhistory++] = strdup(line);
+}
+
+// Start of the word under the cursor. Escaped spaces belong to it
+static size_t word_start(struct edit *e) {
+    size_t i = e->pos;
+
+    while (i > 0 && !(e->buf.str[i - 1] == ' ' &&
+                      (i < 2 || e->buf.str[i - 2] != '\\')))
+        i--;
+    return i;
+}
+
+// Whether the word at start is a command name: first on the line or
+// right after a pipe
+static int command_position(struct edit *e, size_t start) {
+    size_t i = start;
+
+    while (i > 0 && e->buf.str[i - 1] == ' ')
+        i--;
+    return i == 0 || e->buf.str[i - 1] == '|';
+}
+
+static void list_completions(struct edit *e, struct completions *c,
+                             size_t dir_len) {
+    size_t width = 0, len;
+    int i, per_line, shown = c->n < MAX_LISTED ? c->n : MAX_LISTED;
+
+    for (i = 0; i < shown; i++) {
+        if ((len = strlen(c->items[i]) - dir_len) > width)
+            width = len;
+    }
+    width += 2;
+    per_line = columns(e->fd) / width > 0 ? columns(e->fd) / width : 1;
+
+    term_write("\n", 1);
+    for (i = 0; i < shown; i++) {
+        term_printf("%-*s", (int) width, c->items[i] + dir_len);
+        if ((i + 1) % per_line == 0 || i == shown - 1)
+            term_write("\n", 1);
+    }
+    if (shown < c->n)
+        term_printf("(%d more)\n", c->n - shown);
+
+    print_layout();
+}
+
+// Extends the word under the cursor as far as its completions agree,
+// adding a space after a single one. With nothing to add, a second tab
+// lists them
+static void complete_line(struct edit *e, int second_tab) {
+    struct strbuf word = { NULL, 0, 0 }, text = { NULL, 0, 0 };
+    struct completions c;
+    size_t start = word_start(e), common, i;
+    const char *slash;
+    int n;
+
+    // Completions work on the word as the command will see it
+    for (i = start; i < e->pos; i++) {
+        if (e->buf.str[i] == '\\' && i + 1 < e->pos)
+            i++;
+        sb_putn(&word, &e->buf.str[i], 1);
+    }
+    sb_reserve(&word, 0);
+    word.str[word.len] = 0;
+
+    n = complete(word.str, word.len, command_position(e, start), &c);
+    if (n <= 0) {
+        term_write("\a", 1);
+        term_flush();
+        free(word.str);
+        return;
+    }
+
+    common = strlen(c.items[0]);
+    for (n = 1; n < c.n; n++) {
+        for (i = 0; i < common && c.items[n][i] == c.items[0][i]; i++);
+        common = i;
+    }
+
+    if (common > word.len || c.n == 1) {
+        for (i = 0; i < common; i++) {
+            if (strchr(" \\\"'|&<>$`", c.items[0][i]))
+                sb_putn(&text, "\\", 1);
+            sb_putn(&text, &c.items[0][i], 1);
+        }
+        // A single match is a finished word, unless it is a directory or
+        // empty
+        if (c.n == 1 && common > 0 && c.items[0][common - 1] != '/')
+            sb_putn(&text, " ", 1);
+        delete(e, start, e->pos);
+        insert(e, text.str, text.len);
+    } else if (second_tab) {
+        slash = strrchr(word.str, '/');
+        list_completions(e, &c, slash ? (size_t) (slash - word.str) + 1 : 0);
+    } else {
+        term_write("\a", 1);
+    }
+
+    free_completions(&c);
+    free(word.str);
+    free(text.str);
+}
+
+// Reads the key after an escape. Only sequences that move the cursor or
+// delete matter, the others are consumed and ignored
+static int escape_key(Reader in) {
+    int c = reader_getc(in), code = 0;
+
+    if (c != '[' && c != 'O')
+        return 0;
+    while ((c = reader_getc(in)) >= '0' && c <= '9')
+        code = code * 10 + c - '0';
+    if (c == '~')
+        return code == 3 ? KEY_DELETE : code == 1 || code == 7 ? CTRL('A') :
+               code == 4 || code == 8 ? CTRL('E') : 0;
+    switch (c) {
+        case 'A': return CTRL('P');
+        case 'B': return CTRL('N');
+        case 'C': return CTRL('F');
+        case 'D': return CTRL('B');
+        case 'H': return CTRL('A');
+        case 'F': return CTRL('E');
+    }
+    return 0;
+}
+
+// Reads a line from a terminal in raw mode, with emacs style editing,
+// history and tab completion. The terminal is back in the cooked mode
+// given when it returns. Returns what read appended, newline included,
+// or 0 at end of input
+ssize_t edit_line(Reader in, struct strbuf *line, int fd,
+                  struct termios *cooked, int prompt_width) {
+    struct edit e = { { NULL, 0, 0 }, 0, 0, prompt_width, fd };
+    struct termios raw = *cooked;
+    int c, last = 0, h = nhistory, done = 0;
+    char *saved = NULL;
+    ssize_t n = 0;
+
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSADRAIN, &raw);
+
+    sb_reserve(&e.buf, 0);
+    e.buf.str[0] = 0;
+
+    while (!done) {
+        // End of input ends a partial line, the next call reports it
+        if ((c = reader_getc(in)) == EOF && e.buf.len == 0)
+            goto out;
+        if (c == EOF)
+            break;
+        if (c == ESC)
+            c = escape_key(in);
+
+        switch (c) {
+            case '\r':
+            case '\n':
+                done = 1;
+                break;
+            case CTRL('C'):
+                term_write("^C", 2);
+                e.buf.len = e.pos = 0;
+                e.buf.str[0] = 0;
+                done = 1;
+                break;
+            case CTRL('D'):
+                if (e.buf.len == 0) {
+                    term_write("\n", 1);
+                    goto out;
+                }
+                if (e.pos < e.buf.len)
+                    delete(&e, e.pos, e.pos + 1);
+                break;
+            case KEY_DELETE:
+                if (e.pos < e.buf.len)
+                    delete(&e, e.pos, e.pos + 1);
+                break;
+            case DEL:
+            case CTRL('H'):
+                if (e.pos > 0)
+                    delete(&e, e.pos - 1, e.pos);
+                break;
+            case CTRL('A'): e.pos = 0; break;
+            case CTRL('E'): e.pos = e.buf.len; break;
+            case CTRL('B'): if (e.pos > 0) e.pos--; break;
+            case CTRL('F'): if (e.pos < e.buf.len) e.pos++; break;
+            case CTRL('K'): delete(&e, e.pos, e.buf.len); break;
+            case CTRL('U'): delete(&e, 0, e.pos); break;
+            case CTRL('W'): {
+                size_t from = e.pos;
+
+                while (from > 0 && e.buf.str[from - 1] == ' ') from--;
+                while (from > 0 && e.buf.str[from - 1] != ' ') from--;
+                delete(&e, from, e.pos);
+                break;
+            }
+            case CTRL('L'):
+                term_write("\033[H\033[2J", 7);
+                print_layout();
+                break;
+            // The line being typed is kept while walking the history
+            case CTRL('P'):
+            case CTRL('N'):
+                if (c == CTRL('P') ? h == 0 : h == nhistory)
+                    break;
+                if (h == nhistory) {
+                    free(saved);
+                    saved = strdup(e.buf.str);
+                }
+                h += c == CTRL('P') ? -1 : 1;
+                replace(&e, h == nhistory ? saved : history[h]);
+                break;
+            case '\t':
+                complete_line(&e, last == '\t');
+                break;
+            default:
+                if (c >= ' ' && c < 256 && c != DEL) {
+                    char ch = (char) c;
+
+                    insert(&e, &ch, 1);
+                }
+        }
+        last = c;
+        refresh(&e);
+    }
+
+    term_write("\n", 1);
+    term_flush();
+    history_add(e.buf.str);
+    sb_putn(line, e.buf.str, e.buf.len);
+    sb_putn(line, "\n", 1);
+    n = e.buf.len + 1;
+
+out:
+    term_flush();
+    tcsetattr(fd, TCSADRAIN, cooked);
+    free(e.buf.str);
+    free(saved);
+    return n;
+}
@@ -0,0 +1,17 @@
+#ifndef LINEEDIT_H
+#define LINEEDIT_H
+
+    #include <termios.h>
+    #include "input.h"
+
+    // Lines kept for up/down
+    #define EDIT_HISTORY 500
+
+    ssize_t edit_line(Reader, struct strbuf *, int, struct termios *, int);
+
+    // The prompt, provided by the shell. redraw_prompt() prints it again
+    // when a signal asked for a new one while the shell was waiting
+    void print_layout();
+    void redraw_prompt();
+
+#endif
@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include "memo.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define MEMO_MAGIC  "SHMEMO2"
+#define HASH_CHUNK  65536
+#define FNV_OFFSET  0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t h, const char *p, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        h ^= (unsigned char) p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+    ssize_t w;
+
+    while (n > 0) {
+        if ((w = write(fd, buf, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// $MEMO_DIR, or ~/.cache/shell-memo, created on first use
+static const char *cache_dir() {
+    static char dir[PATH_MAX];
+    const char *env = getenv("MEMO_DIR"), *home = getenv("HOME");
+
+    if (env && *env) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else {
+        snprintf(dir, sizeof(dir), "%s/.cache", home ? home : "/tmp");
+        mkdir(dir, 0700);
+        strncat(dir, "/shell-memo", sizeof(dir) - strlen(dir) - 1);
+    }
+
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+        return NULL;
+    return dir;
+}
+
+static void entry_path(char *path, size_t size, const char *dir,
+                       const char *key, size_t len) {
+    snprintf(path, size, "%s/%016llx", dir,
+             (unsigned long long) fnv1a(FNV_OFFSET, key, len));
+}
+
+// Adds an input file to the key: a hash of its content, or with by_mtime
+// only its identity and modification time. -1 if it cannot be read
+int memo_add_file(struct strbuf *key, const char *path, int by_mtime) {
+    char line[PATH_MAX + 128], *buf;
+    struct stat st;
+    uint64_t h = FNV_OFFSET;
+    ssize_t r;
+    int fd, n;
+
+    if (by_mtime) {
+        if (stat(path, &st) == -1)
+            return -1;
+        n = snprintf(line, sizeof(line), "mtime %s %lu %lu %lld %ld.%09ld\n",
+                     path, (unsigned long) st.st_dev,
+                     (unsigned long) st.st_ino, (long long) st.st_size,
+                     (long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    } else {
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+            return -1;
+        buf = (char *) malloc(HASH_CHUNK);
+        while ((r = read(fd, buf, HASH_CHUNK)) > 0 ||
+               (r < 0 && errno == EINTR)) {
+            if (r > 0)
+                h = fnv1a(h, buf, r);
+        }
+        free(buf);
+        close(fd);
+        if (r < 0)
+            return -1;
+        n = snprintf(line, sizeof(line), "input %s %016llx\n", path,
+                     (unsigned long long) h);
+    }
+
+    sb_putn(key, line, n);
+    return 0;
+}
+
+// Opens the entry stored for key. The stored key is compared in full, so
+// a hash collision is just a miss. Returns the entry's fd, or -1
+int memo_lookup(const char *key, size_t len, struct memo_header *h) {
+    const char *dir = cache_dir();
+    char path[PATH_MAX], *stored;
+    int fd, hit;
+
+    if (!dir)
+        return -1;
+    entry_path(path, sizeof(path), dir, key, len);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+
+    stored = (char *) malloc(len + 1);
+    hit = pread(fd, h, sizeof(*h), 0) == sizeof(*h) &&
+          !memcmp(h->magic, MEMO_MAGIC, sizeof(h->magic)) &&
+          h->key_len == len &&
+          pread(fd, stored, len, sizeof(*h)) == (ssize_t) len &&
+          !memcmp(stored, key, len);
+    free(stored);
+
+    if (!hit) {
+        close(fd);
+        return -1;
+    }
+
+    // The modification time is the LRU clock
+    futimens(fd, NULL);
+    return fd;
+}
+
+// Copies count bytes from offset off, within the kernel when the
+// descriptors allow it
+static void send_range(int out, int in, off_t off, uint64_t count) {
+    char buf[HASH_CHUNK];
+    ssize_t n;
+
+    while (count > 0) {
+        n = sendfile(out, in, &off, count);
+        if (n > 0)
+            count -= n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+
+    // sendfile refused the output descriptor
+    while (count > 0 &&
+           (n = pread(in, buf, count < sizeof(buf) ? count : sizeof(buf),
+                      off)) > 0) {
+        if (write_all(out, buf, n) == -1)
+            break;
+        off += n;
+        count -= n;
+    }
+}
+
+// Writes a hit's chunks back to their streams, in order, and returns its
+// exit status
+int memo_replay(int fd, struct memo_header *h) {
+    off_t off = sizeof(*h) + h->key_len, end = off + h->data_len;
+    struct memo_chunk c;
+
+    term_flush();
+    while (off < end && pread(fd, &c, sizeof(c), off) == sizeof(c)) {
+        off += sizeof(c);
+        send_range(c.fd == STDERR_FILENO ? STDERR_FILENO : STDOUT_FILENO, fd,
+                   off, c.len);
+        off += c.len;
+    }
+    close(fd);
+    return h->status;
+}
+
+// Starts writing an entry for key, to a temporary file renamed into
+// place once complete
+int memo_begin(struct memo_entry *e, const char *key, size_t len) {
+    const char *dir = cache_dir();
+
+    e->fd = -1;
+    if (!dir)
+        return -1;
+
+    entry_path(e->path, sizeof(e->path), dir, key, len);
+    snprintf(e->tmp_path, sizeof(e->tmp_path), "%s/.tmp.%d", dir,
+             (int) getpid());
+    e->fd = open(e->tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0600);
+    if (e->fd == -1)
+        return -1;
+
+    memset(&e->header, 0, sizeof(e->header));
+    e->header.key_len = len;
+    if (lseek(e->fd, sizeof(e->header), SEEK_SET) == -1 ||
+        write_all(e->fd, key, len) == -1) {
+        memo_abort(e);
+        return -1;
+    }
+    return 0;
+}
+
+// Appends what the command wrote to fd, as one chunk
+void memo_write(struct memo_entry *e, int fd, const char *buf, size_t n) {
+    struct memo_chunk c;
+
+    if (e->fd < 0)
+        return;
+    c.fd = fd;
+    c.len = n;
+    if (write_all(e->fd, (const char *) &c, sizeof(c)) == -1 ||
+        write_all(e->fd, buf, n) == -1)
+        memo_abort(e);
+    else
+        e->header.data_len += sizeof(c) + n;
+}
+
+void memo_abort(struct memo_entry *e) {
+    if (e->fd >= 0) {
+        close(e->fd);
+        unlink(e->tmp_path);
+        e->fd = -1;
+    }
+}
+
+struct cached_file {
+    char   name[32];
+    off_t  size;
+    struct timespec used;
+};
+
+static int by_use(const void *a, const void *b) {
+    const struct cached_file *x = a, *y = b;
+
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if (x->used.tv_nsec != y->used.tv_nsec)
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// Removes least recently used entries until the cache fits in
+// $MEMO_MAX_SIZE bytes
+static void evict(const char *dir) {
+    const char *env = getenv("MEMO_MAX_SIZE");
+    unsigned long long cap = env ? strtoull(env, NULL, 10) : MEMO_DEFAULT_CAP;
+    unsigned long long total = 0;
+    struct cached_file *files = NULL;
+    struct dirent *de;
+    struct stat st;
+    int n = 0, size = 0, i;
+    DIR *d;
+
+    if (!(d = opendir(dir)))
+        return;
+
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(files->name) ||
+            fstatat(dirfd(d), de->d_name, &st, 0) == -1)
+            continue;
+        if (n == size) {
+            size = size ? 2 * size : 64;
+            files = (struct cached_file *) realloc(files,
+                                                   size * sizeof(*files));
+        }
+        strcpy(files[n].name, de->d_name);
+        files[n].size = st.st_size;
+        files[n].used = st.st_mtim;
+        total += st.st_size;
+        n++;
+    }
+
+    if (total > cap) {
+        qsort(files, n, sizeof(*files), by_use);
+        for (i = 0; i < n && total > cap; i++) {
+            if (unlinkat(dirfd(d), files[i].name, 0) == 0)
+                total -= files[i].size;
+        }
+    }
+
+    closedir(d);
+    free(files);
+}
+
+// Fills in the header and publishes the entry
+void memo_commit(struct memo_entry *e, int status) {
+    char *slash;
+
+    if (e->fd < 0)
+        return;
+
+    memcpy(e->header.magic, MEMO_MAGIC, sizeof(e->header.magic));
+    e->header.status = status;
+
+    if (pwrite(e->fd, &e->header, sizeof(e->header), 0) !=
+            sizeof(e->header) ||
+        rename(e->tmp_path, e->path) == -1) {
+        memo_abort(e);
+        return;
+    }
+    close(e->fd);
+    e->fd = -1;
+
+    if ((slash = strrchr(e->path, '/'))) {
+        *slash = 0;
+        evict(e->path);
+        *slash = '/';
+    }
+}
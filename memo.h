@@ -0,0 +1,40 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+    #include <stdint.h>
+    #include "expand.h"
+
+    // Cache size cap when MEMO_MAX_SIZE is not set
+    #define MEMO_DEFAULT_CAP (64 << 20)
+
+    // An entry is this header, the key, then the output as chunks in the
+    // order they were read, each tagged with the stream it came from
+    struct memo_header {
+        char     magic[8];
+        int32_t  status;
+        uint32_t key_len;
+        uint64_t data_len;
+    };
+
+    struct memo_chunk {
+        uint32_t fd;
+        uint32_t len;
+    };
+
+    // An entry being written on a miss
+    struct memo_entry {
+        int      fd;
+        char     tmp_path[4096];
+        char     path[4096];
+        struct memo_header header;
+    };
+
+    int  memo_add_file(struct strbuf *, const char *, int);
+    int  memo_lookup(const char *, size_t, struct memo_header *);
+    int  memo_replay(int, struct memo_header *);
+    int  memo_begin(struct memo_entry *, const char *, size_t);
+    void memo_write(struct memo_entry *, int, const char *, size_t);
+    void memo_commit(struct memo_entry *, int);
+    void memo_abort(struct memo_entry *);
+
+#endif
@@ -0,0 +1,220 @@
+#include "metrics.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Where the counters go if the shared mapping cannot be made
+static struct shell_metrics local_metrics;
+struct shell_metrics *metrics = &local_metrics;
+
+static const uint64_t latency_bounds[LATENCY_BUCKETS - 1] = LATENCY_BOUNDS;
+static double last_dump = 0;
+
+void metrics_init() {
+    void *shared = mmap(NULL, sizeof(struct shell_metrics),
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+
+    if (shared != MAP_FAILED)
+        metrics = (struct shell_metrics *) shared;
+}
+
+// Records how long the shell took to get a job started, in microseconds
+void metrics_launch(uint64_t us) {
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS - 1 && us > latency_bounds[i]; i++);
+    __atomic_fetch_add(&metrics->launch_latency[i], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&metrics->launch_latency_us, us, __ATOMIC_RELAXED);
+}
+
+void metrics_pipeline(int stages) {
+    if (stages > PIPELINE_BUCKETS)
+        stages = PIPELINE_BUCKETS;
+    __atomic_fetch_add(&metrics->pipelines[stages - 1], 1, __ATOMIC_RELAXED);
+}
+
+// Called as jobs start and finish with the number still running
+void metrics_jobs(size_t live) {
+    uint64_t peak = __atomic_load_n(&metrics->peak_live_jobs,
+                                    __ATOMIC_RELAXED);
+
+    __atomic_store_n(&metrics->live_jobs, live, __ATOMIC_RELAXED);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&metrics->peak_live_jobs, &peak, live,
+                                        1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED));
+}
+
+// Copies the counters one word at a time, each read is atomic on its own
+static void snapshot(struct shell_metrics *copy) {
+    uint64_t *from = (uint64_t *) metrics, *to = (uint64_t *) copy;
+    size_t i;
+
+    for (i = 0; i < sizeof(*copy) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+static void print_counter(FILE *f, const char *name, const char *type,
+                          const char *help, uint64_t value) {
+    fprintf(f, "# HELP shell_%s %s\n# TYPE shell_%s %s\n", name, help, name,
+            type);
+    fprintf(f, "shell_%s{pid=\"%d\"} %llu\n", name, (int) getpid(),
+            (unsigned long long) value);
+}
+
+// Prometheus text exposition format
+static void print_prometheus(FILE *f, struct shell_metrics *m) {
+    uint64_t total = 0;
+    int i, pid = (int) getpid();
+
+    print_counter(f, "commands_parsed_total", "counter",
+                  "Command lines parsed.", m->commands_parsed);
+    print_counter(f, "builtins_total", "counter",
+                  "Commands run as builtins.", m->builtins);
+    print_counter(f, "externals_total", "counter",
+                  "Commands launched as jobs.", m->externals);
+    print_counter(f, "forks_total", "counter",
+                  "Processes created.", m->forks);
+    print_counter(f, "exec_failures_total", "counter",
+                  "Commands that could not be executed.", m->exec_failures);
+
+    fprintf(f, "# HELP shell_launch_latency_seconds Time taken to start a "
+               "job.\n# TYPE shell_launch_latency_seconds histogram\n");
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        total += m->launch_latency[i];
+        if (i < LATENCY_BUCKETS - 1)
+            fprintf(f, "shell_launch_latency_seconds_bucket{pid=\"%d\","
+                       "le=\"%g\"} %llu\n", pid, latency_bounds[i] / 1e6,
+                    (unsigned long long) total);
+        else
+            fprintf(f, "shell_launch_latency_seconds_bucket{pid=\"%d\","
+                       "le=\"+Inf\"} %llu\n", pid,
+                    (unsigned long long) total);
+    }
+    fprintf(f, "shell_launch_latency_seconds_sum{pid=\"%d\"} %g\n", pid,
+            m->launch_latency_us / 1e6);
+    fprintf(f, "shell_launch_latency_seconds_count{pid=\"%d\"} %llu\n", pid,
+            (unsigned long long) total);
+
+    fprintf(f, "# HELP shell_pipelines_total Pipelines run, by stage count."
+               "\n# TYPE shell_pipelines_total counter\n");
+    for (i = 0; i < PIPELINE_BUCKETS; i++)
+        fprintf(f, "shell_pipelines_total{pid=\"%d\",stages=\"%d%s\"} %llu\n",
+                pid, i + 1, i == PIPELINE_BUCKETS - 1 ? "+" : "",
+                (unsigned long long) m->pipelines[i]);
+
+    print_counter(f, "live_jobs", "gauge", "Jobs running.", m->live_jobs);
+    print_counter(f, "peak_live_jobs", "gauge",
+                  "Most jobs ever running at once.", m->peak_live_jobs);
+}
+
+void metrics_print(int prometheus) {
+    struct shell_metrics m;
+    uint64_t launches = 0;
+    int i;
+
+    snapshot(&m);
+    if (prometheus) {
+        char *text = NULL;
+        size_t len = 0;
+        FILE *f = open_memstream(&text, &len);
+
+        if (f) {
+            print_prometheus(f, &m);
+            fclose(f);
+            term_write(text, len);
+            free(text);
+        }
+        return;
+    }
+
+    term_printf("commands parsed  %llu\n", (unsigned long long) m.commands_parsed);
+    term_printf("builtins         %llu\n", (unsigned long long) m.builtins);
+    term_printf("externals        %llu\n", (unsigned long long) m.externals);
+    term_printf("forks            %llu\n", (unsigned long long) m.forks);
+    term_printf("exec failures    %llu\n", (unsigned long long) m.exec_failures);
+    term_printf("live jobs        %llu (peak %llu)\n",
+           (unsigned long long) m.live_jobs,
+           (unsigned long long) m.peak_live_jobs);
+
+    term_printf("pipelines by stages\n");
+    for (i = 0; i < PIPELINE_BUCKETS; i++) {
+        if (m.pipelines[i])
+            term_printf("  %d%s  %llu\n", i + 1,
+                   i == PIPELINE_BUCKETS - 1 ? "+" : " ",
+                   (unsigned long long) m.pipelines[i]);
+    }
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+        launches += m.launch_latency[i];
+    term_printf("launch latency   mean %.1fus\n",
+           launches ? (double) m.launch_latency_us / launches : 0.0);
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (!m.launch_latency[i])
+            continue;
+        if (i < LATENCY_BUCKETS - 1)
+            term_printf("  <= %-6lluus  %llu\n",
+                   (unsigned long long) latency_bounds[i],
+                   (unsigned long long) m.launch_latency[i]);
+        else
+            term_printf("  >  %-6lluus  %llu\n",
+                   (unsigned long long) latency_bounds[i - 1],
+                   (unsigned long long) m.launch_latency[i]);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double dump_interval() {
+    const char *interval = getenv("SHELL_METRICS_INTERVAL");
+
+    return interval ? atof(interval) : METRICS_DEFAULT_INTERVAL;
+}
+
+// Milliseconds until the next dump is due, as a poll() timeout: -1 when
+// there is no $SHELL_METRICS_FILE to keep current
+int metrics_due() {
+    const char *path = getenv("SHELL_METRICS_FILE");
+    double left;
+
+    if (!path || !*path)
+        return -1;
+    left = last_dump ? last_dump + dump_interval() - now() : 0;
+    return left > 0 ? (int) (left * 1000) + 1 : 0;
+}
+
+// Rewrites $SHELL_METRICS_FILE when the interval has passed, or right away
+// when forced. The file is replaced by a rename so readers never see it
+// half written
+void metrics_tick(int force) {
+    const char *path = getenv("SHELL_METRICS_FILE");
+    char tmp[4096];
+    struct shell_metrics m;
+    double t;
+    FILE *f;
+
+    if (!path || !*path)
+        return;
+    t = now();
+    if (!force && last_dump && t - last_dump < dump_interval())
+        return;
+    last_dump = t;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+    if (!(f = fopen(tmp, "w")))
+        return;
+    snapshot(&m);
+    print_prometheus(f, &m);
+    if (fclose(f) != 0 || rename(tmp, path) == -1)
+        unlink(tmp);
+}
@@ -0,0 +1,47 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+    #include <stdint.h>
+    #include <stddef.h>
+
+    // Launch latency histogram, upper bounds in microseconds. The last
+    // bucket has no bound
+    #define LATENCY_BOUNDS   {10, 25, 50, 100, 250, 500, 1000, 2500, 5000, \
+                              10000, 25000}
+    #define LATENCY_BUCKETS  12
+    // Pipelines by stage count, the last bucket holds the longer ones
+    #define PIPELINE_BUCKETS 8
+    // Seconds between two dumps to $SHELL_METRICS_FILE, unless
+    // $SHELL_METRICS_INTERVAL says otherwise
+    #define METRICS_DEFAULT_INTERVAL 15
+
+    // Lives in a shared mapping made before anything forks, so children,
+    // the fork server and serve workers all count into their shell's.
+    // Only relaxed atomic adds touch it: no locks, no syscalls
+    struct shell_metrics {
+        uint64_t commands_parsed;
+        uint64_t builtins;
+        uint64_t externals;
+        uint64_t forks;
+        uint64_t exec_failures;
+        uint64_t launch_latency[LATENCY_BUCKETS];
+        uint64_t launch_latency_us;
+        uint64_t pipelines[PIPELINE_BUCKETS];
+        uint64_t live_jobs;
+        uint64_t peak_live_jobs;
+    };
+
+    extern struct shell_metrics *metrics;
+
+    #define METRIC_INC(field) \
+        __atomic_fetch_add(&metrics->field, 1, __ATOMIC_RELAXED)
+
+    void metrics_init();
+    void metrics_launch(uint64_t);
+    void metrics_pipeline(int);
+    void metrics_jobs(size_t);
+    void metrics_print(int);
+    int  metrics_due();
+    void metrics_tick(int);
+
+#endif
@@ -1,83 +1,236 @@
 #include "parser.h"
+#include "metrics.h"
+#include "color.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 struct command {
-    char  *ptr[CMD_MAX_SIZE + 1];
+    char  **ptr;
     int   len;
+    int   cap;
 };
 
-// Shifts one to left (i.e. \_123\n -> _123\n\n)
-void shift2left(char *str, const char EOL) {
+// Allocates an empty command with room for CMD_MAX_SIZE arguments
+Command new_command() {
+    Command cmd = (Command) malloc(sizeof(struct command));
+
+    cmd->cap = CMD_MAX_SIZE + 1;
+    cmd->ptr = (char **) malloc(cmd->cap * sizeof(char *));
+    cmd->len = 0;
+    cmd->ptr[0] = NULL;
+    return cmd;
+}
+
+// Appends an argument, growing the list so it always keeps a free slot
+// for the terminating NULL
+void push_arg(Command cmd, char *arg) {
+    if (cmd->len + 1 >= cmd->cap) {
+        cmd->cap *= 2;
+        cmd->ptr = (char **) realloc(cmd->ptr, cmd->cap * sizeof(char *));
+    }
+    cmd->ptr[cmd->len++] = arg;
+    cmd->ptr[cmd->len] = NULL;
+}
+
+// Returns the index of the character closing the group opened at
+// str[start] ('(' or '{'), or the last index before EOL if unbalanced
+int skip_group(const char *str, int start, const char EOL) {
+    const char open = str[start], close = open == '(' ? ')' : '}';
+    int depth = 0, i;
+
+    for (i = start; str[i] != EOL; i++) {
+        if (str[i] == open) depth++;
+        else if (str[i] == close && --depth == 0) return i;
+    }
+    return i - 1;
+}
+
+// Characters quoting keeps from the expansions, marked in the tokens
+#define QUOTED_SPECIALS "*?[]\\$`|<>&\001\002"
+
+// Copies c, marked when quoting made it literal
+static int put_quoted(char *out, int w, char c) {
+    if (c && strchr(QUOTED_SPECIALS, c))
+        out[w++] = QUOTE_MARK;
+    out[w++] = c;
+    return w;
+}
+
+// Index of the last character of the expansion or substitution starting
+// at str[r], or -1 when there is none. Between quotes, "<(" is not one
+static int verbatim_end(const char *str, int r, const char EOL, int quoted) {
+    int end;
+
+    if ((str[r] == '$' && (str[r + 1] == '(' || str[r + 1] == '{')) ||
+        (!quoted && (str[r] == '<' || str[r] == '>') && str[r + 1] == '('))
+        return skip_group(str, r + 1, EOL);
+    if (str[r] == '`') {
+        for (end = r + 1; str[end] != EOL && str[end] != '`'; end++);
+        return str[end] == EOL ? end - 1 : end;
+    }
+    return -1;
+}
+
+// Prepares a new line in a single pass: delimiters become '\0', escapes
+// and quotes are dropped, leaving QUOTE_MARK before the characters they
+// made literal and DQUOTE_MARK before the expansions between double
+// quotes. Expansions and substitutions are kept verbatim. A quoted
+// character may take two bytes, out holds twice the line. Without words,
+// closing quotes do not end the token
+static void split_line(const char *str, char *out, const char delim,
+                       const char EOL, int words) {
+    int r = 0, w = 0, end;
+
+    while (str[r] != EOL) {
+        // Delimiter
+        if (str[r] == delim) {
+            out[w++] = 0;
+            r++;
+        }
+        // Expansions and process substitutions are kept verbatim in a
+        // single token
+        else if ((end = verbatim_end(str, r, EOL, 0)) >= 0) {
+            while (r <= end)
+                out[w++] = str[r++];
+        }
+        // Skip character, the next one is taken literally
+        else if (str[r] == '\\') {
+            if (str[++r] != EOL)
+                w = put_quoted(out, w, str[r++]);
+        }
+        // Single quotes, everything up to the closing ones is a single
+        // literal token
+        else if (str[r] == '\'') {
+            for (r++; str[r] != '\'' && str[r] != EOL; r++)
+                w = put_quoted(out, w, str[r]);
+            if (str[r] == '\'') {
+                if (words) out[w++] = 0;
+                r++;
+            }
+        }
+        // Double quotes, everything up to the closing ones is a single
+        // token. Substitutions still run, but nothing is globbed
+        else if (str[r] == '\"') {
+            for (r++; str[r] != '\"' && str[r] != EOL;) {
+                // An expansion, marked so its result is not globbed
+                if (str[r] == '$' || str[r] == '`') {
+                    out[w++] = DQUOTE_MARK;
+                    if ((end = verbatim_end(str, r, EOL, 1)) < 0)
+                        end = r;
+                    while (r <= end)
+                        out[w++] = str[r++];
+                }
+                // Only these characters can be escaped here
+                else if (str[r] == '\\' && str[r + 1] != EOL &&
+                         strchr("$`\"\\", str[r + 1])) {
+                    w = put_quoted(out, w, str[r + 1]);
+                    r += 2;
+                }
+                else
+                    w = put_quoted(out, w, str[r++]);
+            }
+            if (str[r] == '\"') {
+                if (words) out[w++] = 0;
+                r++;
+            }
+        }
+        // A stray mark byte must not pass for one
+        else if (str[r] == QUOTE_MARK || str[r] == DQUOTE_MARK)
+            w = put_quoted(out, w, str[r++]);
+        else
+            out[w++] = str[r++];
+    }
+    out[w] = EOL;
+}
+
+// Marks the quoting of a word kept verbatim, such as the operand of
+// ${v#word}, as split_line() does for a line. out holds twice the word
+void mark_quotes(const char *word, char *out) {
+    split_line(word, out, 0, 0, 0);
+}
+
+// Words the shell gives a meaning to after the expansions
+int is_operator(const char *word) {
+    static const char *operators[] = { "|", "<", ">", ">>", "2>", "&", "&!" };
+    size_t i;
+
+    for (i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        if (!strcmp(word, operators[i]))
+            return 1;
+    }
+    return is_proc_subst(word) != 0;
+}
+
+// A word that reads as an operator only once quoted or expanded keeps a
+// QUOTE_MARK in front until the operators are handled
+char *mark_operator(char *word) {
+    size_t len = strlen(word);
+
+    word = (char *) realloc(word, len + 2);
+    memmove(word + 1, word, len + 1);
+    word[0] = QUOTE_MARK;
+    return word;
+}
+
+// Drops those marks, once pipes, redirections and '&' are taken out
+void unmark_operators(Command cmd) {
     int i;
 
-    for (i = 0; str[i] != EOL; i++)
-        str[i] = str[i + 1];
+    for (i = 0; i < cmd->len; i++) {
+        if (cmd->ptr[i][0] == QUOTE_MARK && is_operator(cmd->ptr[i] + 1))
+            memmove(cmd->ptr[i], cmd->ptr[i] + 1, strlen(cmd->ptr[i]));
+    }
+}
+
+// Drops the quote marks left by split_line(), once the expansions are done
+void remove_quotes(char *word) {
+    char *r = word, *w = word;
+
+    for (; *r; r++) {
+        if ((*r == QUOTE_MARK || *r == DQUOTE_MARK) && r[1])
+            r++;
+        *w++ = *r;
+    }
+    *w = 0;
 }
 
 char* get_token(char* str, const char delim, const char EOL) {
-    static char* my_str = NULL;
-    char* token;
-    int i;
+    static char *line = NULL, *my_str = NULL;
+    int i, len;
 
     // Check if it is a new call
     if (str) {
-        my_str = str;
-
-        // Fills any required delimiter with '\0'
-        for (i = 0; my_str[i] != EOL; i++) {
-            // Delimiter
-            if (my_str[i] == delim) my_str[i] = 0;
-            // Skip character
-            else if(my_str[i] == '\\') shift2left(&my_str[i], EOL);
-            // Single quotes
-            else if(my_str[i] == '\"') {
-                shift2left(&my_str[i], EOL);
-
-                // Look for the next quotes, replaces it with '\0' and
-                // skip everything in between
-                for(; my_str[i] != '\"' && my_str[i] != EOL; i++);
-                if (my_str[i] == '\"') my_str[i] = 0;
-                else i--;
-            }
-        }
+        for (len = 0; str[len] != EOL; len++);
+        free(line);
+        line = my_str = (char *) malloc(2 * len + 1);
+        split_line(str, line, delim, EOL, 1);
     }
 
     // Suppress '\0'
     for(i = 0; my_str[i] == 0; i++);
 
     // Case we've reached an end
-    if(my_str[i] == EOL) return NULL;
-
-    // Copies the token
-    token = strdup(&my_str[i]);
-
-    // Advance to the next token
-    for(; my_str[i] != 0 && my_str[i] != EOL; i++);
-    my_str = &my_str[i];
-
-    // Suppress any remaining EOL
-    for(i = 0; token[i] != 0; i++) {
-        if (token[i] == EOL) {
-            token[i] = 0;
-            break;
-        }
+    if(my_str[i] == EOL) {
+        free(line);
+        line = NULL;
+        return NULL;
     }
 
-    return token;
+    // Copies the token and advances to the next one
+    for(len = 0; my_str[i + len] != 0 && my_str[i + len] != EOL; len++);
+    my_str = &my_str[i + len];
+    return strndup(&my_str[-len], len);
 }
 
 Command parse(char *cmd_str) {
     if (cmd_str) {
         char    *token = get_token(cmd_str, ' ', '\n');
-        Command cmd = (Command) malloc(sizeof(struct command));
-
-        cmd->len = 0;
+        Command cmd = new_command();
 
         // Process token per token
         while(token != NULL) {
-            cmd->ptr[cmd->len++] = token;
+            push_arg(cmd, token);
 
             // Get next token
             token = get_token(NULL, ' ', '\n');
@@ -96,6 +249,7 @@ Command parse(char *cmd_str) {
 
         // Put a NULL value at the end of the args list
         cmd->ptr[cmd->len] = NULL;
+        METRIC_INC(commands_parsed);
         return cmd;
     }
     return NULL;
@@ -112,13 +266,13 @@ char **get_cmd_args(Command cmd) {
 void print_cmd(Command cmd) {
     int i;
 
-    printf("%s (", cmd->ptr[0]);
+    term_printf("%s (", cmd->ptr[0]);
     for (i = 1; i < cmd->len; i++) {
-        printf("%s", cmd->ptr[i]);
+        term_printf("%s", cmd->ptr[i]);
         if (i < cmd->len - 1)
-            printf(", ");
+            term_printf(", ");
     }
-    printf(")");
+    term_printf(")");
 }
 
 void free_cmd(Command *cmd){
@@ -127,100 +281,128 @@ void free_cmd(Command *cmd){
     for (i = 0; i < (*cmd)->len; i++) {
         free((*cmd)->ptr[i]);
     }
+    free((*cmd)->ptr);
     free(*cmd);
     cmd = NULL;
 }
 
 int is_foreground(Command cmd) {
-    return !(strcmp("&", cmd->ptr[cmd->len - 1]) == 0);
+    return !(strcmp("&", cmd->ptr[cmd->len - 1]) == 0 || is_captured(cmd));
+}
+
+// "&!" runs the command in background with its output captured
+int is_captured(Command cmd) {
+    return strcmp("&!", cmd->ptr[cmd->len - 1]) == 0;
 }
 
 int get_cmd_argc(Command cmd) {
     return cmd->len;
 }
 
-struct redirection_t* extract_redirection (char** cmd, const char* check,
-                                           int type) {
-    int i, nops = 0, error = 0, found_idx = -1, last_idx;
-    struct redirection_t* r = (struct redirection_t*)
-                               malloc(sizeof(struct redirection_t));
-    char *temp;
+// Replaces the argument at idx with n new ones, taking ownership of them
+void splice_cmd_args(Command cmd, int idx, char **args, int n) {
+    int tail = cmd->len - idx - 1;
 
-    r->file = NULL;
-    for (i = 0; cmd[i]; i++) {
-        if (!strcmp(cmd[i], check)) {
-            r->type = type;
-            if (cmd[i + 1]) {
-                r->file = cmd[i + 1];
-            }
-            else {
-                error = 1;
-            }
-            found_idx = i;
-            nops++;
-        }
+    if (cmd->len + n >= cmd->cap) {
+        while (cmd->len + n >= cmd->cap) cmd->cap *= 2;
+        cmd->ptr = (char **) realloc(cmd->ptr, cmd->cap * sizeof(char *));
     }
+    free(cmd->ptr[idx]);
+    memmove(&cmd->ptr[idx + n], &cmd->ptr[idx + 1], tail * sizeof(char *));
+    if (n > 0)
+        memcpy(&cmd->ptr[idx], args, n * sizeof(char *));
+    cmd->len += n - 1;
+    cmd->ptr[cmd->len] = NULL;
+}
 
-    if (error || found_idx < 0 || nops > 1) {
-        free(r);
-        return NULL;
-    }
+// Removes the operator and its file from the command. The redirection
+// takes the file over, free it with free_redirection()
+struct redirection_t* extract_redirection(Command cmd, const char* check,
+                                          int type) {
+    struct redirection_t* r;
+    int i, found = -1;
 
-    last_idx = found_idx;
-    temp = cmd[found_idx];
-    for(; cmd[found_idx]; found_idx++) {
-        cmd[found_idx] = cmd[found_idx + 1];
-    }
-    free(temp);
-    found_idx = last_idx;
-    for(; cmd[found_idx]; found_idx++) {
-        cmd[found_idx] = cmd[found_idx + 1];
+    for (i = 0; i < cmd->len; i++) {
+        if (!strcmp(cmd->ptr[i], check)) {
+            // Without a file, or given twice, the words are left alone
+            if (found >= 0 || i + 1 == cmd->len)
+                return NULL;
+            found = i;
+        }
     }
+    if (found < 0)
+        return NULL;
+
+    r = (struct redirection_t*) malloc(sizeof(struct redirection_t));
+    r->type = type;
+    r->file = cmd->ptr[found + 1];
 
+    // The terminating NULL moves along
+    free(cmd->ptr[found]);
+    memmove(&cmd->ptr[found], &cmd->ptr[found + 2],
+            (cmd->len - found - 1) * sizeof(char *));
+    cmd->len -= 2;
     return r;
 }
 
-int count_pipes(Command cmd) {
-    int i, count = 0;
-
-    if (!strcmp(cmd->ptr[cmd->len - 1], "|")) {
-        return 0;
+void free_redirection(struct redirection_t* r) {
+    if (r) {
+        free(r->file);
+        free(r);
     }
+}
+
+// Number of pipes in the command, -1 when one of them is missing the
+// command on its left or right
+int count_pipes(Command cmd) {
+    int i, count = 0, after_pipe = 1;
 
     for (i = 0; i < cmd->len; i++) {
         if (!strcmp(cmd->ptr[i], "|")) {
+            if (after_pipe)
+                return -1;
             count++;
+            after_pipe = 1;
+        } else {
+            after_pipe = 0;
         }
     }
-    return count;
+    return after_pipe ? -1 : count;
 }
 
+// Returns PSUB_IN for "<(cmd)", PSUB_OUT for ">(cmd)" and 0 otherwise
+int is_proc_subst(const char *word) {
+    size_t len = strlen(word);
+
+    if (len < 3 || word[1] != '(' || word[len - 1] != ')')
+        return 0;
+    return word[0] == '<' ? PSUB_IN : word[0] == '>' ? PSUB_OUT : 0;
+}
+
+// Splits the command on its count pipes, as counted by count_pipes().
+// The arguments move to the new commands, the pipes are freed
 Command* break_into_commands(Command cmd, int count) {
     int i, j = 0;
     Command* cmds;
-    Command new_cmd;
 
-    cmds = (Command *) malloc((count + 1) * sizeof(Command *));
+    cmds = (Command *) malloc((count + 1) * sizeof(Command));
 
     if (!count) {
         cmds[0] = cmd;
         return cmds;
     }
-    new_cmd = (Command) malloc(sizeof(struct command));
-    new_cmd->len = 0;
-    cmd->ptr[cmd->len] = "|";
 
-    for (i = 0; i <= cmd->len; i++) {
+    cmds[0] = new_command();
+    for (i = 0; i < cmd->len; i++) {
         if (!strcmp(cmd->ptr[i], "|")) {
-            new_cmd->ptr[new_cmd->len] = 0;
-            cmds[j++] = new_cmd;
-            new_cmd = (Command) malloc(sizeof(struct command));
-            new_cmd->len = 0;
+            free(cmd->ptr[i]);
+            cmds[++j] = new_command();
         }
         else {
-            new_cmd->ptr[new_cmd->len++] = cmd->ptr[i];
+            push_arg(cmds[j], cmd->ptr[i]);
         }
     }
+    free(cmd->ptr);
     free(cmd);
     return cmds;
 }
@@ -11,6 +11,15 @@
     #define RERR        3
     #define RIN         4
 
+    // Marks split_line() leaves in a token before a character quoting
+    // made literal, and before a '$' or '`' expanded between double quotes
+    #define QUOTE_MARK  '\001'
+    #define DQUOTE_MARK '\002'
+
+    // Process substitution types
+    #define PSUB_IN     1
+    #define PSUB_OUT    2
+
     struct redirection_t {
         int type;
         char *file;
@@ -19,16 +28,27 @@
     typedef struct command *Command;
 
     Command parse(char *);
+    Command new_command();
+    void push_arg(Command, char *);
+    void splice_cmd_args(Command, int, char **, int);
     char *get_cmd_name(Command);
     char **get_cmd_args(Command);
     char* get_token(char* str, const char delim, const char EOL);
     int is_foreground(Command);
+    int is_captured(Command);
     int get_cmd_argc(Command);
     void free_cmd(Command *);
     void print_cmd(Command);
-    struct redirection_t* extract_redirection (char **, const char* check,
+    struct redirection_t* extract_redirection (Command, const char* check,
                                                int type);
+    void free_redirection(struct redirection_t *);
     Command* break_into_commands(Command, int);
     int count_pipes(Command);
+    int is_proc_subst(const char *);
+    void remove_quotes(char *);
+    void mark_quotes(const char *, char *);
+    int is_operator(const char *);
+    char *mark_operator(char *);
+    void unmark_operators(Command);
 
 #endif
@@ -0,0 +1,301 @@
+// Benchmark and fuzz harness for the parser. Every line goes through what
+// the shell does to a command line before running it: parse(), the pipe
+// split and the redirections.
+//
+//     parser_bench [-n rounds] [-g count] [corpus file or directory]...
+//
+// parses the corpus lines, plus count generated ones, rounds times and
+// reports the throughput in MB/s and lines/s with the allocations per
+// line. Built with -DPARSER_FUZZ (make fuzz, under ASan) it instead runs
+// the fuzz entry point on each file, or on stdin, as AFL does:
+//
+//     afl-fuzz -i parser_corpus -o findings ./parser_fuzz @@
+//
+// and with -DPARSER_LIBFUZZER (make libfuzzer) libFuzzer drives it:
+//
+//     ./parser_fuzz parser_corpus
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "parser.h"
+
+#define DEFAULT_ROUNDS    20
+#define DEFAULT_GENERATED 100000
+
+static const char *redirections[] = { ">", ">>", "<", "2>" };
+static const int  redirection_types[] = { ROUT, ROUT_APPEND, RIN, RERR };
+
+// Parses one line the way the shell would before running it
+static void parse_one(char *line) {
+    struct redirection_t *r;
+    Command cmd, *cmds;
+    int pipes, i, j;
+
+    if (!(cmd = parse(line)))
+        return;
+    if ((pipes = count_pipes(cmd)) < 0) {
+        free_cmd(&cmd);
+        return;
+    }
+
+    cmds = break_into_commands(cmd, pipes);
+    for (i = 0; i <= pipes; i++) {
+        for (j = 0; j < 4; j++) {
+            r = extract_redirection(cmds[i], redirections[j],
+                                    redirection_types[j]);
+            free_redirection(r);
+        }
+        is_proc_subst(get_cmd_name(cmds[i]) ? get_cmd_name(cmds[i]) : "");
+        if (get_cmd_argc(cmds[i]) > 0)
+            is_foreground(cmds[i]);
+        free_cmd(&cmds[i]);
+    }
+    free(cmds);
+}
+
+// Fuzz entry point: the input is split in lines, each parsed on its own
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *buf = (char *) malloc(size + 2), *line, *nl;
+
+    memcpy(buf, data, size);
+    buf[size] = '\n';
+    buf[size + 1] = 0;
+    for (line = buf; line < buf + size; line = nl + 1) {
+        nl = memchr(line, '\n', buf + size + 1 - line);
+        parse_one(line);
+    }
+    free(buf);
+    return 0;
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "parser_bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static char *read_file(FILE *f, size_t *size) {
+    char *data = NULL;
+    size_t cap = 0, n;
+
+    *size = 0;
+    do {
+        if (*size == cap) {
+            cap = cap ? 2 * cap : 65536;
+            data = (char *) realloc(data, cap);
+        }
+        n = fread(data + *size, 1, cap - *size, f);
+        *size += n;
+    } while (n > 0);
+    return data;
+}
+
+#ifndef PARSER_LIBFUZZER
+#ifdef PARSER_FUZZ
+
+int main(int argc, char **argv) {
+    size_t size;
+    char *data;
+    FILE *f;
+    int i;
+
+    for (i = 1; i < argc || i == 1; i++) {
+        if (argc == 1) f = stdin;
+        else if (!(f = fopen(argv[i], "r"))) die(argv[i]);
+        data = read_file(f, &size);
+        LLVMFuzzerTestOneInput((const uint8_t *) data, size);
+        free(data);
+        if (f != stdin) fclose(f);
+    }
+    return 0;
+}
+
+#else
+
+// Allocation counts, through glibc's own allocator
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static uint64_t allocs = 0, alloc_bytes = 0;
+
+void *malloc(size_t n) {
+    allocs++;
+    alloc_bytes += n;
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs++;
+    alloc_bytes += n * size;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n) {
+    allocs++;
+    alloc_bytes += n;
+    return __libc_realloc(p, n);
+}
+
+struct corpus {
+    char   **lines;
+    size_t count;
+    size_t cap;
+    size_t bytes;
+};
+
+// Takes the lines of data, each kept with its '\n' as parse() expects
+static void add_lines(struct corpus *c, const char *data, size_t size) {
+    const char *line = data, *nl;
+    size_t len;
+
+    while (line < data + size) {
+        nl = memchr(line, '\n', data + size - line);
+        len = nl ? (size_t) (nl - line) : (size_t) (data + size - line);
+        if (c->count == c->cap) {
+            c->cap = c->cap ? 2 * c->cap : 1024;
+            c->lines = (char **) realloc(c->lines, c->cap * sizeof(char *));
+        }
+        c->lines[c->count] = (char *) malloc(len + 2);
+        memcpy(c->lines[c->count], line, len);
+        memcpy(&c->lines[c->count][len], "\n", 2);
+        c->count++;
+        c->bytes += len + 1;
+        line += len + 1;
+    }
+}
+
+static void add_path(struct corpus *c, const char *path) {
+    char sub[4096], *data;
+    struct dirent *e;
+    struct stat st;
+    size_t size;
+    FILE *f;
+    DIR *d;
+
+    if (stat(path, &st) == -1)
+        die(path);
+    if (S_ISDIR(st.st_mode)) {
+        if (!(d = opendir(path)))
+            die(path);
+        while ((e = readdir(d))) {
+            if (e->d_name[0] == '.')
+                continue;
+            snprintf(sub, sizeof(sub), "%s/%s", path, e->d_name);
+            add_path(c, sub);
+        }
+        closedir(d);
+        return;
+    }
+
+    if (!(f = fopen(path, "r")))
+        die(path);
+    data = read_file(f, &size);
+    add_lines(c, data, size);
+    free(data);
+    fclose(f);
+}
+
+// Command lines made of the words the shell gives a meaning to, mixed
+// with plain ones of every length. The seed is fixed so runs compare
+static void generate(struct corpus *c, size_t count) {
+    static const char *words[] = {
+        "ls", "-la", "grep", "-n", "foo", "|", "|", ">", ">>", "<", "2>",
+        "out.txt", "&", "&!", "*.c", "\\*", "'a b'", "\"$HOME/x y\"",
+        "$(cat f)", "${v%%.*}", "`date`", "<(sort a)", ">(wc -l)",
+        "x=1", "$((1 + 2))", "a\\ b", "--long-option=value"
+    };
+    const size_t nwords = sizeof(words) / sizeof(words[0]);
+    char line[4096];
+    size_t i, len, n, w, k;
+
+    srand(1);
+    for (i = 0; i < count; i++) {
+        len = 0;
+        n = 1 + rand() % 16;
+        for (w = 0; w < n && len < sizeof(line) - 512; w++) {
+            if (w) line[len++] = ' ';
+            if (rand() % 4) {
+                k = rand() % nwords;
+                memcpy(&line[len], words[k], strlen(words[k]));
+                len += strlen(words[k]);
+            } else {
+                for (k = 1 + rand() % (rand() % 8 ? 12 : 400); k > 0; k--)
+                    line[len++] = 'a' + rand() % 26;
+            }
+        }
+        add_lines(c, line, len);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    struct corpus c = { NULL, 0, 0, 0 };
+    long rounds = DEFAULT_ROUNDS, generated = -1;
+    uint64_t a0, b0, lines;
+    double start, elapsed;
+    int opt, i;
+    long r;
+
+    while ((opt = getopt(argc, argv, "n:g:")) != -1) {
+        switch (opt) {
+            case 'n': rounds = atol(optarg); break;
+            case 'g': generated = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: parser_bench [-n rounds] "
+                        "[-g count] [corpus]...\n");
+                return 2;
+        }
+    }
+    for (i = optind; i < argc; i++)
+        add_path(&c, argv[i]);
+    if (generated < 0)
+        generated = optind < argc ? 0 : DEFAULT_GENERATED;
+    generate(&c, generated);
+    if (c.count == 0 || rounds <= 0) {
+        fprintf(stderr, "parser_bench: nothing to parse\n");
+        return 1;
+    }
+
+    // One round first, so the timed ones start warm
+    for (i = 0; i < (int) c.count; i++)
+        parse_one(c.lines[i]);
+
+    a0 = allocs;
+    b0 = alloc_bytes;
+    start = now();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < (int) c.count; i++)
+            parse_one(c.lines[i]);
+    }
+    elapsed = now() - start;
+    lines = (uint64_t) rounds * c.count;
+
+    printf("%zu lines (%zu generated), %.1f KB, %ld rounds in %.3fs\n",
+           c.count, (size_t) generated, c.bytes / 1024.0, rounds, elapsed);
+    printf("%.1f MB/s, %.0f lines/s\n",
+           (double) c.bytes * rounds / elapsed / 1e6, lines / elapsed);
+    printf("%.2f allocations and %.0f bytes allocated per line\n",
+           (double) (allocs - a0) / lines,
+           (double) (alloc_bytes - b0) / lines);
+
+    for (i = 0; i < (int) c.count; i++)
+        free(c.lines[i]);
+    free(c.lines);
+    return 0;
+}
+
+#endif
+#endif
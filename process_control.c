@@ -1,5 +1,9 @@
 #include <stdlib.h>
+#include <sys/wait.h>
 #include "process_control.h"
+#include "capture.h"
+#include "watchdog.h"
+#include "metrics.h"
 
 Jobl create_jobl() {
     Jobl list = (Jobl) malloc(sizeof(struct jobl));
@@ -11,18 +15,125 @@ Jobl create_jobl() {
 }
 
 Jobl add_job(Jobl list, Job job) {
-    Jobl_tail temp = list->head;
+    Jobl_tail node = (Jobl_tail) malloc(sizeof(struct jobl_tail));
 
-    list->head = (Jobl_tail) malloc(sizeof(struct jobl_tail));
+    // The SIGINT handler walks the list, so the node is complete before
+    // it is linked
     job->is_valid = VALID;
-    list->head->item = job;
-    list->head->next = temp;
+    job->is_foreground = 0;
+    node->item = job;
+    node->next = list->head;
+    list->head = node;
     list->jid_count++;
     list->size++;
 }
 
+// Running jobs by pid, in an open addressing table, so reaping a child
+// finds its job without walking the whole history
+static Job    *pid_index = NULL;
+static size_t index_cap = 0, index_count = 0;
+
+static size_t pid_slot(pid_t pid) {
+    return ((size_t) pid * 2654435761u) & (index_cap - 1);
+}
+
+static void index_insert(Job job) {
+    size_t i = pid_slot(job->pid);
+
+    while (pid_index[i])
+        i = (i + 1) & (index_cap - 1);
+    pid_index[i] = job;
+    index_count++;
+}
+
+void index_job(Job job) {
+    if (job->pid <= 0)
+        return;
+
+    // Keep the load under a half
+    if (2 * (index_count + 1) > index_cap) {
+        Job *old = pid_index;
+        size_t i, old_cap = index_cap;
+
+        index_cap = index_cap ? 2 * index_cap : 64;
+        pid_index = (Job *) calloc(index_cap, sizeof(Job));
+        index_count = 0;
+        for (i = 0; i < old_cap; i++) {
+            if (old[i])
+                index_insert(old[i]);
+        }
+        free(old);
+    }
+    index_insert(job);
+    metrics_jobs(index_count);
+}
+
+Job job_by_pid(pid_t pid) {
+    size_t i;
+
+    if (!index_cap)
+        return NULL;
+    for (i = pid_slot(pid); pid_index[i]; i = (i + 1) & (index_cap - 1)) {
+        if (pid_index[i]->pid == pid)
+            return pid_index[i];
+    }
+    return NULL;
+}
+
+// Removes the job, shifting back the entries that probed past its slot
+static void unindex_job(Job job) {
+    size_t i, j, home;
+
+    if (!index_cap || job->pid <= 0)
+        return;
+    for (i = pid_slot(job->pid); pid_index[i] != job;
+         i = (i + 1) & (index_cap - 1)) {
+        if (!pid_index[i])
+            return;
+    }
+
+    pid_index[i] = NULL;
+    index_count--;
+    for (j = (i + 1) & (index_cap - 1); pid_index[j];
+         j = (j + 1) & (index_cap - 1)) {
+        home = pid_slot(pid_index[j]->pid);
+        if (((j - home) & (index_cap - 1)) >= ((j - i) & (index_cap - 1))) {
+            pid_index[i] = pid_index[j];
+            pid_index[j] = NULL;
+            i = j;
+        }
+    }
+    metrics_jobs(index_count);
+}
+
 void invalidate_job(Job job) {
+    if (job->is_valid == VALID)
+        unindex_job(job);
     job->is_valid = INVALID;
+    unwatch_job(job);
+}
+
+// Shell encoding of a wait status: the exit code, or 128 plus the signal
+int exit_code(int status) {
+    if (status == -1)
+        return 0;
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// Collects the process substitutions started along with the job.
+// With WNOHANG, the ones still running are kept for a later call
+void reap_job_subs(Job job, int options) {
+    int i, n = 0;
+
+    for (i = 0; i < job->nsubs; i++) {
+        if (waitpid(job->subs[i], NULL, options) == 0)
+            job->subs[n++] = job->subs[i];
+    }
+    job->nsubs = n;
 }
 
 void free_jobl(Jobl list) {
@@ -32,6 +143,8 @@ void free_jobl(Jobl list) {
         Jobl_tail temp = head;
 
         free_cmd(&(head->item->cmd));
+        free(head->item->subs);
+        close_capture(head->item->capture);
         free(head->item);
         head = head->next;
         free(temp);
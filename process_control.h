@@ -3,6 +3,7 @@
 
     #include <sys/types.h>
     #include "parser.h"
+    #include "rlimits.h"
 
     typedef struct job *Job;
     typedef struct jobl      *Jobl;
@@ -15,6 +16,15 @@
         int   status;
         int   is_valid;
         int   is_foreground;
+        pid_t *subs;
+        int   nsubs;
+        struct capture *capture;
+        double deadline;     // monotonic time of the next watchdog action
+        int   timeout_sig;   // signal sent when the deadline passes
+        double kill_after;   // grace period before SIGKILL
+        int   timed_out;     // last signal the watchdog sent
+        int   waited_on;     // named by the wait builtin running now
+        struct job_limits limits; // set between fork and exec
     };
 
     struct jobl_tail {
@@ -30,7 +40,11 @@
 
     Jobl create_jobl();
     Jobl add_job(Jobl, Job);
+    void index_job(Job);
+    Job  job_by_pid(pid_t);
     void invalidate_job(Job);
+    int  exit_code(int);
+    void reap_job_subs(Job, int);
     void free_jobl(Jobl);
 
 #endif
@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include "record.h"
+#include "parser.h"
+#include "process_control.h"
+#include "input.h"
+#include "forksrv.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+// Provided by the shell
+extern Jobl job_list;
+
+static int    record_fd = -1;
+static double session_start, cmd_start;
+static struct strbuf pending = { NULL, 0, 0 };
+static char   pending_cwd[PATH_MAX];
+static int    started = 0;
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Starts a recording, replacing the file. The header carries the wall
+// clock start, offsets in the records are monotonic from there
+int record_open(const char *path) {
+    struct timespec ts;
+    char header[64];
+    int n;
+
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                     0644);
+    if (record_fd == -1)
+        return -1;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    session_start = now();
+    n = snprintf(header, sizeof(header), RECORD_MAGIC "\t%lld.%06ld\n",
+                 (long long) ts.tv_sec, ts.tv_nsec / 1000);
+    if (write(record_fd, header, n) != n) {
+        record_close();
+        return -1;
+    }
+    return 0;
+}
+
+// Keeps the line and where it runs, before the command changes either
+void record_start(const char *line, size_t len) {
+    if (record_fd < 0)
+        return;
+
+    if (len > 0 && line[len - 1] == '\n')
+        len--;
+    pending.len = 0;
+    sb_putn(&pending, line, len);
+    if (!getcwd(pending_cwd, sizeof(pending_cwd)))
+        strcpy(pending_cwd, ".");
+    started = 1;
+    cmd_start = now();
+}
+
+// Appends the directory with its tabs, newlines and backslashes escaped,
+// so it stays one field of one line
+static void put_dir(struct strbuf *rec, const char *dir) {
+    for (; *dir; dir++) {
+        if (*dir == '\t')
+            sb_putn(rec, "\\t", 2);
+        else if (*dir == '\n')
+            sb_putn(rec, "\\n", 2);
+        else if (*dir == '\\')
+            sb_putn(rec, "\\\\", 2);
+        else
+            sb_putn(rec, dir, 1);
+    }
+}
+
+// Undoes put_dir() in place
+static void unescape_dir(char *dir) {
+    char *out = dir;
+
+    for (; *dir; dir++) {
+        if (*dir == '\\' && dir[1]) {
+            dir++;
+            *out++ = *dir == 't' ? '\t' : *dir == 'n' ? '\n' : *dir;
+        } else {
+            *out++ = *dir;
+        }
+    }
+    *out = 0;
+}
+
+// Writes the record of the command started last, in a single write so a
+// crash loses at most the command that was running
+void record_end(int status) {
+    struct strbuf rec = { NULL, 0, 0 };
+    char head[96];
+    double end = now();
+    int n;
+
+    if (record_fd < 0 || !started)
+        return;
+    started = 0;
+
+    n = snprintf(head, sizeof(head), "%.6f\t%.6f\t%d\t",
+                 cmd_start - session_start, end - cmd_start, status);
+    sb_putn(&rec, head, n);
+    put_dir(&rec, pending_cwd);
+    sb_putn(&rec, "\t", 1);
+    sb_putn(&rec, pending.str, pending.len);
+    sb_putn(&rec, "\n", 1);
+
+    if (write(record_fd, rec.str, rec.len) != (ssize_t) rec.len) {
+        set_color(RED);
+        term_printf("ERROR: recording stopped (error code %d)\n", errno);
+        set_color(NONE);
+        record_close();
+    }
+    free(rec.str);
+}
+
+void record_close() {
+    if (record_fd >= 0)
+        close(record_fd);
+    record_fd = -1;
+    free(pending.str);
+    pending.str = NULL;
+    pending.len = pending.cap = 0;
+}
+
+// Splits a record in place. Fails on anything but the five fields
+static int parse_record(char *rec, double *offset, double *duration,
+                        int *status, char **dir, char **line) {
+    char *end, *tab;
+
+    *offset = strtod(rec, &end);
+    if (end == rec || *end != '\t')
+        return -1;
+    *duration = strtod(rec = end + 1, &end);
+    if (end == rec || *end != '\t')
+        return -1;
+    *status = (int) strtol(rec = end + 1, &end, 10);
+    if (end == rec || *end != '\t')
+        return -1;
+
+    *dir = end + 1;
+    if (!(tab = strchr(*dir, '\t')))
+        return -1;
+    *tab = 0;
+    *line = tab + 1;
+    unescape_dir(*dir);
+    return 0;
+}
+
+static void sleep_until(double t) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - (time_t) t) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Nearest rank percentile of n sorted values
+static double percentile(const double *v, int n, double p) {
+    int rank = (int) (p * n);
+
+    if (rank < p * n)
+        rank++;
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_percentiles(const char *name, double *v, int n) {
+    qsort(v, n, sizeof(double), compare_doubles);
+    fprintf(stderr, "%-9s %10.3f %10.3f %10.3f\n", name,
+            percentile(v, n, 0.5) * 1e3, percentile(v, n, 0.99) * 1e3,
+            v[n - 1] * 1e3);
+}
+
+// Runs the commands of a recording, as fast as possible or, paced, each
+// at its recorded offset from the start. The commands' output goes where
+// the shell's does, the timings to stderr: one line per command with its
+// recorded and replayed latency, then percentiles and throughput
+int replay_main(const char *path, int paced) {
+    struct strbuf rec = { NULL, 0, 0 }, line = { NULL, 0, 0 };
+    double *recorded = NULL, *replayed = NULL, *delta = NULL;
+    double start, begin, elapsed, busy = 0, total = 0, offset, duration;
+    int fd, n = 0, cap = 0, status, mismatches = 0, missing_dirs = 0;
+    char *dir, *text, action = 0;
+    Jobl_tail tail;
+    Command cmd;
+    Reader in;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        set_color(RED);
+        term_printf("ERROR: %s: %s\n", path, strerror(errno));
+        set_color(NONE);
+        term_flush();
+        return 1;
+    }
+    in = open_reader(fd, RD_BUFFERED);
+    if (reader_getdelim(in, &rec, '\n') <= 0 ||
+        strncmp(rec.str, RECORD_MAGIC, strlen(RECORD_MAGIC))) {
+        set_color(RED);
+        term_printf("ERROR: %s: not a recording\n", path);
+        set_color(NONE);
+        term_flush();
+        close_reader(in);
+        close(fd);
+        free(rec.str);
+        return 1;
+    }
+
+    stdin_reader = open_reader(STDIN_FILENO, RD_BUFFERED);
+    fprintf(stderr, "    #   recorded   replayed      delta  (ms)\n");
+
+    start = now();
+    while (action != QUIT) {
+        rec.len = 0;
+        if (reader_getdelim(in, &rec, '\n') <= 0)
+            break;
+        if (rec.str[rec.len - 1] == '\n')
+            rec.str[--rec.len] = 0;
+        if (parse_record(rec.str, &offset, &duration, &status, &dir, &text))
+            continue;
+
+        // Paced, the think time between commands is kept. A command
+        // already late starts right away
+        if (paced)
+            sleep_until(start + offset);
+        if (chdir(dir) == -1)
+            missing_dirs++;
+
+        line.len = 0;
+        sb_putn(&line, text, strlen(text));
+        sb_putn(&line, "\n", 1);
+
+        begin = now();
+        if ((cmd = parse(line.str)))
+            action = execute_cmd(cmd);
+        elapsed = now() - begin;
+        term_flush();
+
+        if (n == cap) {
+            cap = cap ? 2 * cap : 256;
+            recorded = (double *) realloc(recorded, cap * sizeof(double));
+            replayed = (double *) realloc(replayed, cap * sizeof(double));
+            delta = (double *) realloc(delta, cap * sizeof(double));
+        }
+        recorded[n] = duration;
+        replayed[n] = elapsed;
+        delta[n] = elapsed - duration;
+        busy += elapsed;
+        total += duration;
+        n++;
+
+        fprintf(stderr, "%5d %10.3f %10.3f %+10.3f  %s", n, duration * 1e3,
+                elapsed * 1e3, (elapsed - duration) * 1e3, text);
+        if (last_status != status) {
+            fprintf(stderr, "  [status %d, recorded %d]", last_status, status);
+            mismatches++;
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (n > 0) {
+        fprintf(stderr, "\n%d commands in %.3fs, %.1f commands/s (recorded "
+                "%.1f commands/s)\n", n, now() - start,
+                busy > 0 ? n / busy : 0, total > 0 ? n / total : 0);
+        fprintf(stderr, "%-9s %10s %10s %10s\n", "(ms)", "p50", "p99", "max");
+        print_percentiles("recorded", recorded, n);
+        print_percentiles("replayed", replayed, n);
+        print_percentiles("delta", delta, n);
+        fprintf(stderr, "%d status mismatches\n", mismatches);
+        if (missing_dirs)
+            fprintf(stderr, "%d commands ran outside their recorded "
+                    "directory\n", missing_dirs);
+    } else {
+        fprintf(stderr, "no commands replayed\n");
+    }
+
+    // Same ending as an interactive session
+    forksrv_stop();
+    for (tail = job_list->head; tail; tail = tail->next) {
+        if (tail->item->is_valid == VALID)
+            kill(tail->item->pid, SIGTERM);
+    }
+
+    close_reader(in);
+    close(fd);
+    close_reader(stdin_reader);
+    free(rec.str);
+    free(line.str);
+    free(recorded);
+    free(replayed);
+    free(delta);
+    return 0;
+}
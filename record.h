@@ -0,0 +1,27 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+    #include <stddef.h>
+    #include "parser.h"
+
+    // execute_cmd() result asking the shell to exit
+    #define QUIT 2
+
+    // First line of a recording, followed by the session's start time
+    #define RECORD_MAGIC "# shell-record 1"
+
+    // A recording is the magic line, then one line per command:
+    // start offset and duration in seconds, exit status, working
+    // directory and the command line, tab separated. Tabs, newlines and
+    // backslashes in the directory are written \t, \n and \\ instead
+    int  record_open(const char *);
+    void record_start(const char *, size_t);
+    void record_end(int);
+    void record_close();
+
+    int  replay_main(const char *, int);
+
+    // Provided by the shell
+    char execute_cmd(Command);
+
+#endif
@@ -0,0 +1,235 @@
+#include "rlimits.h"
+#include "color.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BYTES   0
+#define SECONDS 1
+#define COUNT   2
+
+// Indexes into the table below
+#define LIM_AS     0
+#define LIM_CPU    2
+#define LIM_DATA   3
+#define LIM_FSIZE  4
+#define LIM_NOFILE 5
+#define LIM_NPROC  6
+#define LIM_STACK  7
+
+static const struct {
+    const char *name;
+    int        resource;
+    int        unit;
+} limits[NLIMITS] = {
+    {"as", RLIMIT_AS, BYTES}, {"core", RLIMIT_CORE, BYTES},
+    {"cpu", RLIMIT_CPU, SECONDS}, {"data", RLIMIT_DATA, BYTES},
+    {"fsize", RLIMIT_FSIZE, BYTES}, {"nofile", RLIMIT_NOFILE, COUNT},
+    {"nproc", RLIMIT_NPROC, COUNT}, {"stack", RLIMIT_STACK, BYTES}
+};
+
+struct job_limits shell_limits = { 0 };
+
+// Parses unlimited or a number: bytes take a K, M, G or T suffix (powers
+// of 1024), seconds an s, m or h one
+static int parse_value(const char *str, int unit, rlim_t *value) {
+    unsigned long long v, scale = 1;
+    char *end;
+
+    if (!strcmp(str, "unlimited")) {
+        *value = RLIM_INFINITY;
+        return 1;
+    }
+    if (!isdigit((unsigned char) str[0]))
+        return 0;
+    errno = 0;
+    v = strtoull(str, &end, 10);
+    if (errno)
+        return 0;
+
+    // Each unit falls through to the smaller ones
+    if (unit == BYTES) {
+        switch (tolower((unsigned char) *end)) {
+            case 't': scale *= 1024;
+            case 'g': scale *= 1024;
+            case 'm': scale *= 1024;
+            case 'k': scale *= 1024; end++;
+            case 0:   break;
+            default:  return 0;
+        }
+    } else if (unit == SECONDS) {
+        switch (*end) {
+            case 'h': scale *= 60;
+            case 'm': scale *= 60;
+            case 's': end++;
+            case 0:   break;
+            default:  return 0;
+        }
+    }
+    if (*end || v > (RLIM_INFINITY - 1) / scale)
+        return 0;
+
+    *value = v * scale;
+    return 1;
+}
+
+// Writes the value the way parse_value() reads it, in the largest unit
+// that divides it
+static void format_value(int i, rlim_t value, char *buf, size_t len) {
+    const char *units = "KMGT";
+    int u = -1;
+
+    if (value == RLIM_INFINITY) {
+        snprintf(buf, len, "unlimited");
+        return;
+    }
+    while (limits[i].unit == BYTES && u < 3 && value >= 1024 &&
+           value % 1024 == 0) {
+        value /= 1024;
+        u++;
+    }
+    if (u >= 0)
+        snprintf(buf, len, "%llu%c", (unsigned long long) value, units[u]);
+    else
+        snprintf(buf, len, "%llu", (unsigned long long) value);
+}
+
+// Reads a NAME=VALUE word into the limits. Returns NULL, or why the word
+// was refused
+const char *parse_limit(const char *word, struct job_limits *l) {
+    const char *eq = strchr(word, '=');
+    struct rlimit rl;
+    rlim_t value;
+    int i;
+
+    for (i = 0; eq && i < NLIMITS; i++) {
+        if (strlen(limits[i].name) == (size_t) (eq - word) &&
+            !strncmp(word, limits[i].name, eq - word))
+            break;
+    }
+    if (!eq || i == NLIMITS)
+        return "unknown limit";
+    if (!parse_value(eq + 1, limits[i].unit, &value))
+        return "invalid value";
+
+    // Only root may raise a hard limit, better to refuse it here than in
+    // every child
+    if (value != RLIM_INFINITY && getrlimit(limits[i].resource, &rl) == 0 &&
+        rl.rlim_max != RLIM_INFINITY && value > rl.rlim_max && geteuid() != 0)
+        return "above the hard limit";
+
+    l->set |= 1u << i;
+    l->value[i] = value;
+    return NULL;
+}
+
+// Limits set in src override the ones in dst
+void merge_limits(struct job_limits *dst, const struct job_limits *src) {
+    int i;
+
+    for (i = 0; i < NLIMITS; i++) {
+        if (src->set & (1u << i))
+            dst->value[i] = src->value[i];
+    }
+    dst->set |= src->set;
+}
+
+// Called in the child before exec. Soft and hard limits both drop to the
+// value, so the job cannot raise them back, except for the CPU one that
+// keeps LIMIT_CPU_GRACE seconds between SIGXCPU and SIGKILL
+int apply_limits(const struct job_limits *l) {
+    struct rlimit rl;
+    int i;
+
+    for (i = 0; i < NLIMITS; i++) {
+        if (!(l->set & (1u << i)) || l->value[i] == RLIM_INFINITY)
+            continue;
+        if (getrlimit(limits[i].resource, &rl) == -1)
+            return -1;
+
+        rl.rlim_cur = l->value[i];
+        if (i != LIM_CPU || l->value[i] >= RLIM_INFINITY - LIMIT_CPU_GRACE)
+            rl.rlim_max = l->value[i];
+        else if (rl.rlim_max == RLIM_INFINITY ||
+                 rl.rlim_max >= l->value[i] + LIMIT_CPU_GRACE)
+            rl.rlim_max = l->value[i] + LIMIT_CPU_GRACE;
+        else if (rl.rlim_max < l->value[i])
+            rl.rlim_max = l->value[i];
+
+        if (setrlimit(limits[i].resource, &rl) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Writes "name=value" for limit i if it is set and not lifted
+static int describe(const struct job_limits *l, int i, char *buf,
+                    size_t len) {
+    size_t n;
+
+    if (!(l->set & (1u << i)) || l->value[i] == RLIM_INFINITY)
+        return 0;
+    n = snprintf(buf, len, "%s=", limits[i].name);
+    if (n < len)
+        format_value(i, l->value[i], buf + n, len - n);
+    return 1;
+}
+
+// Tells whether a job that ended with status was killed by one of its
+// limits, naming it in buf. SIGXCPU and SIGXFSZ only come from a limit,
+// SIGKILL comes from the CPU hard limit when there is one. A job out of
+// memory usually crashes or aborts, and so only likely hit its memory
+// limit. Running out of descriptors or processes leaves no trace in the
+// status, the job just fails
+int limit_hit(const struct job_limits *l, int status, char *buf,
+              size_t len) {
+    static const int memory[] = { LIM_AS, LIM_DATA, LIM_STACK };
+    int sig, i;
+
+    if (!l->set || status == -1 || !WIFSIGNALED(status))
+        return LIMIT_NONE;
+    sig = WTERMSIG(status);
+
+    if (sig == SIGXCPU && describe(l, LIM_CPU, buf, len))
+        return LIMIT_CERTAIN;
+    if (sig == SIGXFSZ && describe(l, LIM_FSIZE, buf, len))
+        return LIMIT_CERTAIN;
+    if (sig == SIGKILL && describe(l, LIM_CPU, buf, len))
+        return LIMIT_LIKELY;
+
+    if (sig == SIGKILL || sig == SIGSEGV || sig == SIGBUS || sig == SIGABRT) {
+        for (i = 0; i < 3; i++) {
+            if (describe(l, memory[i], buf, len))
+                return LIMIT_LIKELY;
+        }
+    }
+    return LIMIT_NONE;
+}
+
+// One line per limit: the default for jobs, then the shell's own soft
+// and hard limits
+void print_limits(const struct job_limits *l) {
+    char def[32], soft[32], hard[32];
+    struct rlimit rl;
+    int i;
+
+    set_color(BLUE);
+    term_printf("LIMIT\tJOBS\t\tSOFT\t\tHARD\n");
+    set_color(NONE);
+    for (i = 0; i < NLIMITS; i++) {
+        if (l->set & (1u << i))
+            format_value(i, l->value[i], def, sizeof(def));
+        else
+            snprintf(def, sizeof(def), "-");
+        if (getrlimit(limits[i].resource, &rl) == -1)
+            rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+        format_value(i, rl.rlim_cur, soft, sizeof(soft));
+        format_value(i, rl.rlim_max, hard, sizeof(hard));
+        term_printf("%s\t%-15s\t%-15s\t%s\n", limits[i].name, def, soft, hard);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef RLIMITS_H
+#define RLIMITS_H
+
+    #include <stddef.h>
+    #include <sys/resource.h>
+
+    // as, core, cpu, data, fsize, nofile, nproc and stack
+    #define NLIMITS 8
+    // Seconds of CPU between SIGXCPU and SIGKILL, for jobs that catch it
+    #define LIMIT_CPU_GRACE 5
+
+    // limit_hit() results
+    #define LIMIT_NONE    0
+    #define LIMIT_CERTAIN 1
+    #define LIMIT_LIKELY  2
+
+    // Resource limits of a job, set in the child between fork and exec.
+    // Only the limits in the set mask apply, RLIM_INFINITY lifts a default
+    struct job_limits {
+        unsigned set;
+        rlim_t   value[NLIMITS];
+    };
+
+    // Defaults for every job, set with ulimit
+    extern struct job_limits shell_limits;
+
+    const char *parse_limit(const char *, struct job_limits *);
+    void merge_limits(struct job_limits *, const struct job_limits *);
+    int  apply_limits(const struct job_limits *);
+    int  limit_hit(const struct job_limits *, int, char *, size_t);
+    void print_limits(const struct job_limits *);
+
+#endif
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include "serve.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include "parser.h"
+#include "process_control.h"
+#include "expand.h"
+#include "input.h"
+#include "forksrv.h"
+#include "color.h"
+#include "metrics.h"
+
+// A connection runs at most one request at a time; further requests wait
+// in the socket until its worker has been reaped
+struct client {
+    int   fd;
+    pid_t pid;
+};
+
+// Provided by the shell
+extern Jobl job_list;
+char execute_cmd(Command);
+
+static struct client clients[SERVE_MAX_CLIENTS];
+static int nclients = 0;
+static int listen_fd = -1, signal_fd = -1;
+
+// The client hung up: jobs sit in process groups of their own, so they
+// are terminated one by one before the worker goes
+static void cancel_request(int signo) {
+    Jobl_tail tail;
+
+    for (tail = job_list->head; tail; tail = tail->next) {
+        if (tail->item->is_valid == VALID && tail->item->pid > 0)
+            kill(-tail->item->pid, SIGTERM);
+    }
+    _exit(128 + signo);
+}
+
+// Worker side: a forked copy of the resident shell runs one command line
+// against the client's descriptors, in its own process group and with a
+// job list of its own, and never returns
+static void run_request(char *buf, size_t n, int *fds) {
+    struct serve_req *req = (struct serve_req *) buf;
+    char *p = buf + sizeof(*req), *end = buf + n, *fields[2], *nul;
+    struct strbuf line = { NULL, 0, 0 };
+    sigset_t none;
+    Command cmd;
+    int i, status;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    setpgid(0, 0);
+
+    for (i = 0; i < FORKSRV_FDS; i++)
+        dup2(fds[i], i);
+    close(listen_fd);
+    close(signal_fd);
+    for (i = 0; i < nclients; i++)
+        close(clients[i].fd);
+
+    // cwd and command line
+    for (i = 0; i < 2; i++) {
+        if (p >= end || !(nul = (char *) memchr(p, 0, end - p)))
+            _exit(2);
+        fields[i] = p;
+        p = nul + 1;
+    }
+    if (chdir(fields[0]) == -1) {
+        set_color(RED);
+        term_printf("ERROR: %s: %s\n", fields[0], strerror(errno));
+        set_color(NONE);
+        term_flush();
+        _exit(1);
+    }
+
+    // Environment overrides
+    for (i = 0; i < (int) req->envc && p < end; i++) {
+        if (!(nul = (char *) memchr(p, 0, end - p)))
+            break;
+        putenv(p);
+        p = nul + 1;
+    }
+
+    job_list = create_jobl();
+    signal(SIGTERM, cancel_request);
+    stdin_reader = open_reader(STDIN_FILENO, RD_BYTE);
+
+    sb_putn(&line, fields[1], strlen(fields[1]));
+    sb_putn(&line, "\n", 1);
+    if ((cmd = parse(line.str)))
+        execute_cmd(cmd);
+    status = last_status;
+
+    // Background jobs belong to the request too
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+
+    term_flush();
+    _exit(status);
+}
+
+static void send_reply(int fd, int error, int status, struct rusage *usage) {
+    struct serve_reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.error = error;
+    reply.status = status;
+    if (usage)
+        reply.usage = *usage;
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void drop_client(int i) {
+    close(clients[i].fd);
+    clients[i] = clients[--nclients];
+}
+
+// Reads one request from a connection and forks its worker
+static void handle_request(int i, char *buf) {
+    int fds[FORKSRV_FDS], nfds, j;
+    ssize_t n = recv_with_fds(clients[i].fd, buf, SERVE_MAX_MSG, fds, &nfds);
+    pid_t pid;
+
+    if (n <= 0) {
+        if (n == 0 || errno != EAGAIN)
+            drop_client(i);
+        return;
+    }
+
+    if (nfds != FORKSRV_FDS || (size_t) n < sizeof(struct serve_req)) {
+        send_reply(clients[i].fd, EINVAL, 0, NULL);
+    } else {
+        term_flush();
+        if ((pid = fork()) == 0)
+            run_request(buf, n, fds);
+        if (pid < 0) {
+            send_reply(clients[i].fd, errno, 0, NULL);
+        } else {
+            METRIC_INC(forks);
+            clients[i].pid = pid;
+        }
+    }
+
+    for (j = 0; j < nfds; j++)
+        close(fds[j]);
+}
+
+// Answers every connection whose worker has finished
+static void reap_workers() {
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int status, i;
+    pid_t pid;
+
+    while (read(signal_fd, &info, sizeof(info)) > 0)
+        ;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        for (i = 0; i < nclients; i++) {
+            if (clients[i].pid == pid) {
+                send_reply(clients[i].fd, 0, status, &usage);
+                clients[i].pid = 0;
+                break;
+            }
+        }
+    }
+}
+
+static void accept_clients() {
+    int fd;
+
+    while (nclients < SERVE_MAX_CLIENTS &&
+           (fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        clients[nclients].fd = fd;
+        clients[nclients].pid = 0;
+        nclients++;
+    }
+}
+
+// Whether nothing listens on the socket at addr any more. Only a refused
+// connection tells, a server that is busy or of another kind is alive
+static int is_stale(struct sockaddr_un *addr) {
+    int fd, stale;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return 0;
+    stale = connect(fd, (struct sockaddr *) addr, sizeof(*addr)) == -1 &&
+            errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+// Resident mode: accepts connections on a SOCK_SEQPACKET socket and runs
+// each request in a worker forked from this already initialised shell.
+// A single poll loop waits on the socket, the clients and SIGCHLD
+int serve_main(const char *path) {
+    struct pollfd pfds[SERVE_MAX_CLIENTS + 2];
+    struct sockaddr_un addr;
+    struct stat st;
+    char *buf;
+    sigset_t mask;
+    int i, n;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        set_color(RED);
+        term_printf("ERROR: socket path too long\n");
+        set_color(NONE);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // A socket left by an earlier server is replaced, one a server still
+    // listens on and anything else at that path are kept
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            set_color(RED);
+            term_printf("ERROR: %s: exists and is not a socket\n", path);
+            set_color(NONE);
+            return 1;
+        }
+        if (!is_stale(&addr)) {
+            set_color(RED);
+            term_printf("ERROR: %s: already serving\n", path);
+            set_color(NONE);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       0);
+    if (listen_fd == -1 ||
+        bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        set_color(RED);
+        term_printf("ERROR: %s: %s\n", path, strerror(errno));
+        set_color(NONE);
+        return 1;
+    }
+
+    // SIGCHLD is only ever seen through the signalfd
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    buf = (char *) malloc(SERVE_MAX_MSG);
+
+    for (;;) {
+        pfds[0].fd = signal_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = nclients < SERVE_MAX_CLIENTS ? listen_fd : -1;
+        pfds[1].events = POLLIN;
+
+        // Busy connections are only watched for hangups
+        for (i = 0; i < nclients; i++) {
+            pfds[i + 2].fd = clients[i].fd;
+            pfds[i + 2].events = clients[i].pid ? 0 : POLLIN;
+        }
+        n = nclients;
+
+        // Wakes up for the metrics dump too, idle or not
+        if (poll(pfds, n + 2, metrics_due()) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        metrics_tick(0);
+
+        if (pfds[0].revents & POLLIN)
+            reap_workers();
+
+        // Walk backwards, dropping a client moves the last one into its slot
+        for (i = n - 1; i >= 0; i--) {
+            short ev = pfds[i + 2].revents;
+
+            if (ev & POLLIN) {
+                handle_request(i, buf);
+            } else if (ev & (POLLHUP | POLLERR)) {
+                // Nobody is left to read the worker's output
+                if (clients[i].pid > 0)
+                    kill(-clients[i].pid, SIGTERM);
+                drop_client(i);
+            }
+        }
+
+        if (pfds[1].revents & POLLIN)
+            accept_clients();
+    }
+
+    free(buf);
+    return 1;
+}
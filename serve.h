@@ -0,0 +1,29 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+    #include <stdint.h>
+    #include <sys/resource.h>
+
+    // Requests and replies of the --serve mode. Both ends share this
+    // header, shellc.c is the client
+    #define SERVE_MAX_MSG     65536
+    #define SERVE_MAX_CLIENTS 256
+
+    // A request is this header followed by the cwd, the command line and
+    // envc NAME=value overrides, each NUL terminated. The client's stdin,
+    // stdout and stderr are attached as SCM_RIGHTS
+    struct serve_req {
+        uint32_t envc;
+    };
+
+    // Sent once the request's worker has been reaped. status is the
+    // worker's wait status, error is an errno when the request was refused
+    struct serve_reply {
+        int32_t error;
+        int32_t status;
+        struct rusage usage;
+    };
+
+    int serve_main(const char *);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,31 +8,83 @@
 #include "parser.h"
 #include "color.h"
 #include "process_control.h"
+#include "expand.h"
+#include "input.h"
+#include "forksrv.h"
+#include "serve.h"
+#include "capture.h"
+#include "watchdog.h"
+#include "memo.h"
+#include "metrics.h"
+#include "lineedit.h"
+#include "complete.h"
+#include "rlimits.h"
+#include "record.h"
+#include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
 
-#define MAX_INPUT_SIZE 1000
 #define RUNNING        1
 #define SUCCESS        1
-#define QUIT           2
 #define FAIL           0
 #define TRUE           1
 #define FALSE          0
+#define SUBST_CHUNK    65536
+// How often memo checks whether the job it is reading from was stopped
+#define MEMO_POLL_MS   200
+#define ARG_HEADROOM   2048
+// The kernel's MAX_ARG_STRLEN, the longest a single argument may be
+#define ARG_STRLEN_MAX (32 * sysconf(_SC_PAGESIZE))
+#define PROMPT_WIDTH   4   // "G1> "
+
+// A <(cmd) or >(cmd) argument, read or written by the job through the
+// outer end of a pipe whose inner end is the inner command's stdout/stdin
+struct proc_subst {
+    int  type;
+    int  outer_fd;
+    int  inner_fd;
+    char *cmd_line;
+};
 
 extern int errno;
 
 char execute_cmd(Command);
+char run_pipeline(Command);
 void print_layout();
 void terminate_foreground(int);
+static void reap_interrupted();
 void stop_foreground(int);
 char try_internal_cmd(Command);
-void launch_job(Command, int, int, int);
+Job  launch_job(Command, int, int, int, int);
+void record_internal_job(Command);
+void exec_job(Command, int, int, int);
+void run_subshell(Command);
+int  open_proc_substs(Command, struct proc_subst *);
+void start_proc_substs(Job, struct proc_subst *, int);
 char cd_cmd(Command);
 char update_jobs_status_cmd();
 char history_cmd();
 char quit_cmd(Command);
+char is_assignment(const char *);
+char assign_cmd(Command);
+char set_cmd(Command);
+char read_cmd(Command);
+char xargs_cmd(Command);
+char joblog_cmd(Command);
+char timeout_cmd(Command);
+char wait_cmd(Command);
+char memo_cmd(Command);
+char stats_cmd(Command);
+char ulimit_cmd(Command);
+char limit_cmd(Command);
+Job  wait_any_job(Job *, int);
 Job get_job(int, int);
 char bg_cmd(Command cmd);
 char fg_cmd(Command cmd);
@@ -49,41 +102,148 @@ Jobl job_list;
 // in foreground or not
 char exc_foreground = FALSE;
 
+// Set by the signal handlers when the prompt should be drawn again, which
+// is left to the main loop as printing is not async-signal-safe
+static volatile sig_atomic_t prompt_lost = FALSE;
+
+// Set by Ctrl-C once the foreground jobs were signalled. The handler only
+// kills, reaping and dropping them from the pid index and the watchdog is
+// left to the main loop
+static volatile sig_atomic_t fg_interrupted = FALSE;
+
 struct termios shell_tmodes;
 int    shell_terminal;
 int    shell_is_interactive;
 pid_t  shell_pgid;
 
+// Options toggled with set -o/+o
+int shell_options = 0;
+
+// $? and $!
+int last_status = 0;
+int last_bg_pid = 0;
+
+// Status of the last command substitution of the line, -1 when it had
+// none. A line of assignments ends with it
+static int subst_status = -1;
+
+// Limits given by the limit builtin, on top of the ulimit defaults, for
+// the jobs its command launches
+static struct job_limits *prefix_limits = NULL;
+
+static const struct {
+    const char *name;
+    int        flag;
+} option_names[] = {
+    {"globstar", OPT_GLOBSTAR},
+    {"capture",  OPT_CAPTURE}
+};
+
 int main (int argc, char **argv, char **envp) {
-    char cmd_line[MAX_INPUT_SIZE];
-    char *notEOF;
+    struct strbuf cmd_line = { NULL, 0, 0 };
+    Reader shell_input;
     Command cmd;
-
-    // Handling signals
-    signal(SIGINT, terminate_foreground);
-    signal(SIGTSTP, stop_foreground);
+    char *record = NULL, *replay = NULL;
+    int editing, fork_server = FALSE, paced = FALSE, i;
+    struct sigaction sa;
+
+    // Counters are shared with every process forked from here on
+    metrics_init();
+
+    // Handling signals. Reads are not restarted, so one blocked at the
+    // prompt returns to draw a new prompt
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = terminate_foreground;
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = stop_foreground;
+    sigaction(SIGTSTP, &sa, NULL);
 
     // Creates a new empty job list
     job_list = create_jobl();
 
+    // Resident mode, commands arrive over a socket instead of stdin
+    if (argc > 2 && strcmp(argv[1], "--serve") == 0) {
+        i = serve_main(argv[2]);
+        term_flush();
+        return i;
+    }
+
     init_shell();
 
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--fork-server"))
+            fork_server = TRUE;
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+            record = argv[++i];
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+            replay = argv[++i];
+        else if (!strcmp(argv[i], "--paced"))
+            paced = TRUE;
+    }
+
+    // Launches go through a helper forked before the shell grows
+    if (fork_server && forksrv_start() == -1) {
+        set_color(RED);
+        term_printf("ERROR: unable to start the fork server\n");
+        set_color(NONE);
+    }
+
+    // A recorded session runs in place of the input
+    if (replay)
+        return replay_main(replay, paced);
+
+    // Every command line is logged with its timing
+    if (record && record_open(record) == -1) {
+        set_color(RED);
+        term_printf("ERROR: %s: unable to record (error code %d)\n", record,
+                    errno);
+        set_color(NONE);
+    }
+
+    // The shell's input is block buffered and shared with the read builtin
+    shell_input = open_reader(STDIN_FILENO, RD_BUFFERED);
+    stdin_reader = shell_input;
+
+    // A terminal on both ends gets the line editor
+    editing = shell_is_interactive && isatty(STDOUT_FILENO) &&
+              !(getenv("TERM") && !strcmp(getenv("TERM"), "dumb"));
+
+    // Command completion has its index ready by the first tab
+    if (editing)
+        complete_prepare();
+
     // Parse and execute line
-    while(notEOF) {
+    while(TRUE) {
+        metrics_tick(FALSE);
+        reap_interrupted();
+        prompt_lost = FALSE;
         print_layout();
 
-        // Read line from input
-        notEOF = fgets(cmd_line, sizeof(cmd_line), stdin);
+        // Read line from input, stop on ctrl + d
+        cmd_line.len = 0;
+        if ((editing ? edit_line(shell_input, &cmd_line, shell_terminal,
+                                 &shell_tmodes, PROMPT_WIDTH)
+                     : reader_getdelim(shell_input, &cmd_line, '\n')) == 0)
+            break;
+        if (cmd_line.str[cmd_line.len - 1] != '\n')
+            sb_putn(&cmd_line, "\n", 1);
 
-        // Case not a ctrl + d and a successful parse occurred
-        if (notEOF && (cmd = parse(cmd_line))) {
+        // Case a successful parse occurred
+        record_start(cmd_line.str, cmd_line.len);
+        if ((cmd = parse(cmd_line.str))) {
             char action = execute_cmd(cmd);
+            record_end(last_status);
             if (action == QUIT)
                 break;
         }
     }
 
-    printf("Exiting...\n");
+    term_printf("Exiting...\n");
+    term_flush();
+    forksrv_stop();
+    metrics_tick(TRUE);
+    record_close();
 
     // Kill any remaining alive process
     Jobl_tail tail = job_list->head;
@@ -98,6 +258,8 @@ int main (int argc, char **argv, char **envp) {
 
     // Free list of commands
     free_jobl(job_list);
+    close_reader(shell_input);
+    free(cmd_line.str);
 
     return 0;
 }
@@ -119,12 +281,17 @@ void init_shell() {
         signal (SIGQUIT, SIG_IGN);
         signal (SIGTTIN, SIG_IGN);
         signal (SIGTTOU, SIG_IGN);
-        signal (SIGCHLD, SIG_IGN);
+
+        // Children must stay waitable: with SIGCHLD ignored they are
+        // reaped by the kernel and waiting for any one of them blocks
+        // until all are gone
+        signal (SIGCHLD, SIG_DFL);
 
         // Put ourselves in our own process group
         shell_pgid = getpid();
         if (setpgid(shell_pgid, shell_pgid) < 0) {
-          printf("ERROR: Couldn't put the shell in its own process group");
+          term_printf("ERROR: Couldn't put the shell in its own process group");
+          term_flush();
           exit(1);
         }
 
@@ -133,91 +300,90 @@ void init_shell() {
 
         // Save default terminal attributes for shell to restored later
         if (tcgetattr(shell_terminal, &shell_tmodes) == -1){
-            printf("ERROR: unable to save default terminal state");
+            term_printf("ERROR: unable to save default terminal state");
         }
     }
 }
 
+// The prompt ends a frame
 void print_layout() {
     set_color(GREEN);
-    printf("\nG1> ");
+    term_printf("\nG1> ");
     set_color(NONE);
+    term_flush();
+}
+
+void redraw_prompt() {
+    if (prompt_lost) {
+        prompt_lost = FALSE;
+        print_layout();
+    }
 }
 
-void launch_job(Command cmd, int foreground, int in, int out) {
+// Forks the command as a new job. Waiting for a foreground job is left
+// to the caller, so every stage of a pipeline is running before any wait
+Job launch_job(Command cmd, int foreground, int in, int out, int err) {
     Job new_job = (Job) malloc(sizeof(struct job));
+    struct proc_subst substs[CMD_MAX_SIZE];
+    struct timespec start, end;
+    int nsubsts, served, i;
     pid_t pid;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    METRIC_INC(externals);
+    term_flush();
+
     // Assign the command related to the job
     new_job->cmd = cmd;
+    new_job->subs = NULL;
+    new_job->nsubs = 0;
+    new_job->capture = NULL;
+    new_job->deadline = 0;
+    new_job->timed_out = 0;
+    new_job->waited_on = FALSE;
+    new_job->limits = shell_limits;
+    if (prefix_limits)
+        merge_limits(&new_job->limits, prefix_limits);
+
+    // Pipes for process substitutions must exist before the fork
+    nsubsts = open_proc_substs(cmd, substs);
+
+    // The fork server launches from its own small address space. Process
+    // substitutions need pipe ends only a fork of the shell holds
+    pid = -1;
+    if (nsubsts == 0 && forksrv_running())
+        pid = forksrv_spawn(cmd, foreground, shell_is_interactive, in, out,
+                            err, &new_job->limits);
+    served = pid > 0;
 
     // Child process
-    if ((pid = fork()) == 0) {
-        char **cmd_args = get_cmd_args(cmd);
-        int i;
-
+    if (pid < 0 && (pid = fork()) == 0) {
         // Put the current process in its own process group
         pid = getpid();
         setpgid(pid, pid);
 
-        // Case the command is supposed to execute in foreground
-        // remove the '&' from the args
-        if(!foreground)
-            cmd_args[get_cmd_argc(cmd) - 1] = NULL;
-
-        // Else, in case we are in foreground,
-        // grab control over the terminal
-        else if (tcsetpgrp (shell_terminal, pid) == -1){
-            printf("ERROR: unable to grab control over the terminal I/O\n");
-        }
-
-        //signal (SIGINT, SIG_DFL);
-        //signal (SIGQUIT, SIG_DFL);
-        //signal (SIGTSTP, SIG_DFL);
-        //signal (SIGTTIN, SIG_DFL);
-        //signal (SIGTTOU, SIG_DFL);
-        //signal (SIGCHLD, SIG_DFL);
+        // The /dev/fd paths must survive the exec
+        for (i = 0; i < nsubsts; i++)
+            fcntl(substs[i].outer_fd, F_SETFD, 0);
 
-        // Handles redirection
-        struct redirection_t* r = extract_redirection(cmd_args, ">", ROUT);
-        if (r) {
-            handle_redirection(r);
+        // In case we are in foreground, grab control over the terminal
+        if (foreground && shell_is_interactive &&
+            tcsetpgrp (shell_terminal, pid) == -1){
+            term_printf("ERROR: unable to grab control over the terminal I/O\n");
         }
-        free(r);
-        r = extract_redirection(cmd_args, ">>", ROUT_APPEND);
-        if (r) {
-            handle_redirection(r);
-        }
-        free(r);
-        r = extract_redirection(cmd_args, "<", RIN);
-        if (r) {
-            handle_redirection(r);
-        }
-        free(r);
-        r = extract_redirection(cmd_args, "2>", RERR);
-        if (r) {
-            handle_redirection(r);
-        }
-        free(r);
 
-        // Handle pipes
-        if (in != 0) {
-            dup2 (in, 0);
-            close (in);
-        }
-        if (out != 1) {
-            dup2 (out, 1);
-            close (out);
-        }
+        if (err != STDERR_FILENO)
+            dup2(err, STDERR_FILENO);
 
-        // Change the child code to the called external command
-        if (execvp(cmd_args[0], cmd_args) < 0) {
+        if (apply_limits(&new_job->limits) == -1) {
             set_color(RED);
-            printf("ERROR: Command ");
-            print_cmd(cmd);
-            printf(" not found (error code %d)\n", errno);
-            exit(1);
+            term_printf("ERROR: unable to set the limits (error code %d)\n",
+                        errno);
+            term_flush();
+            _exit(1);
         }
+
+        exec_job(cmd, foreground, in, out);
     }
     // Parent process
     else {
@@ -232,12 +398,151 @@ void launch_job(Command cmd, int foreground, int in, int out) {
 
         // Put the new job into its own process group
         setpgid(pid, pid);
+        index_job(new_job);
+
+        // Inner commands join the job, so they are signalled and reaped
+        // along with it
+        start_proc_substs(new_job, substs, nsubsts);
+
+        // The counter is for the shell's own forks
+        if (pid > 0 && !served)
+            METRIC_INC(forks);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        metrics_launch((end.tv_sec - start.tv_sec) * 1000000 +
+                       (end.tv_nsec - start.tv_nsec) / 1000);
+    }
+    return new_job;
+}
+
+// Opens a pipe for every <(cmd) and >(cmd) argument and replaces the
+// argument with the /dev/fd path of the end the job will use. Both ends
+// are close-on-exec, only the job clears it on its own end
+int open_proc_substs(Command cmd, struct proc_subst *substs) {
+    char **args = get_cmd_args(cmd), path[32];
+    int i, n = 0, fd[2];
+
+    for (i = 0; args[i] && n < CMD_MAX_SIZE; i++) {
+        int type = is_proc_subst(args[i]);
+
+        if (!type || pipe2(fd, O_CLOEXEC) == -1)
+            continue;
+
+        substs[n].type = type;
+        substs[n].outer_fd = type == PSUB_IN ? fd[0] : fd[1];
+        substs[n].inner_fd = type == PSUB_IN ? fd[1] : fd[0];
+        substs[n].cmd_line = args[i];
+
+        snprintf(path, sizeof(path), "/dev/fd/%d", substs[n].outer_fd);
+        args[i] = strdup(path);
+        n++;
+    }
+    return n;
+}
 
-        // Wait for the child in foreground to terminate
-        if (foreground) {
-            put_in_foreground(new_job);
+// Forks the inner commands into the job's process group and records
+// them in the job, then drops the shell's copies of the pipes
+void start_proc_substs(Job job, struct proc_subst *substs, int n) {
+    int i;
+
+    if (n > 0)
+        job->subs = (pid_t *) malloc(n * sizeof(pid_t));
+
+    for (i = 0; i < n; i++) {
+        struct proc_subst *ps = &substs[i];
+        pid_t pid;
+
+        term_flush();
+        if ((pid = fork()) == 0) {
+            size_t len = strlen(ps->cmd_line);
+            Command cmd;
+
+            setpgid(0, job->pid);
+            dup2(ps->inner_fd, ps->type == PSUB_IN ? STDOUT_FILENO
+                                                   : STDIN_FILENO);
+
+            // Strip "<(" and ")", parse() wants a newline terminated line
+            ps->cmd_line[len - 1] = '\n';
+            cmd = parse(&ps->cmd_line[2]);
+            if (!cmd || expand_cmd(cmd) == INVALID)
+                _exit(1);
+            run_subshell(cmd);
+        }
+        if (pid > 0) {
+            METRIC_INC(forks);
+            setpgid(pid, job->pid);
+            job->subs[job->nsubs++] = pid;
         }
     }
+
+    for (i = 0; i < n; i++) {
+        close(substs[i].outer_fd);
+        close(substs[i].inner_fd);
+        free(substs[i].cmd_line);
+    }
+}
+
+// Child side of a launch: applies redirections and pipe ends, then
+// replaces the process image with the command. Never returns
+void exec_job(Command cmd, int foreground, int in, int out) {
+    char **cmd_args = get_cmd_args(cmd);
+
+    // Case the command is supposed to execute in background
+    // remove the '&' or '&!' from the args
+    if(!foreground && !is_foreground(cmd))
+        splice_cmd_args(cmd, get_cmd_argc(cmd) - 1, NULL, 0);
+
+    //signal (SIGINT, SIG_DFL);
+    //signal (SIGQUIT, SIG_DFL);
+    //signal (SIGTSTP, SIG_DFL);
+    //signal (SIGTTIN, SIG_DFL);
+    //signal (SIGTTOU, SIG_DFL);
+    //signal (SIGCHLD, SIG_DFL);
+
+    // Handles redirection
+    struct redirection_t* r = extract_redirection(cmd, ">", ROUT);
+    if (r) {
+        handle_redirection(r);
+    }
+    free_redirection(r);
+    r = extract_redirection(cmd, ">>", ROUT_APPEND);
+    if (r) {
+        handle_redirection(r);
+    }
+    free_redirection(r);
+    r = extract_redirection(cmd, "<", RIN);
+    if (r) {
+        handle_redirection(r);
+    }
+    free_redirection(r);
+    r = extract_redirection(cmd, "2>", RERR);
+    if (r) {
+        handle_redirection(r);
+    }
+    free_redirection(r);
+    unmark_operators(cmd);
+
+    // Handle pipes
+    if (in != 0) {
+        dup2 (in, 0);
+        close (in);
+    }
+    if (out != 1) {
+        dup2 (out, 1);
+        close (out);
+    }
+
+    // Change the child code to the called external command
+    if (execvp(cmd_args[0], cmd_args) < 0) {
+        METRIC_INC(exec_failures);
+        set_color(RED);
+        term_printf("ERROR: Command ");
+        print_cmd(cmd);
+        term_printf(" not found (error code %d)\n", errno);
+
+        // _exit, so the shell's buffered input is not rewound for it
+        term_flush();
+        _exit(1);
+    }
 }
 
 void handle_redirection(struct redirection_t *r) {
@@ -248,6 +553,7 @@ void handle_redirection(struct redirection_t *r) {
             fd = fileno(fopen(r->file, "w+"));
             dup2(fd, STDOUT_FILENO);
             close(fd);
+            break;
         case RIN:
             fd = fileno(fopen(r->file, "r"));
             dup2(fd, STDIN_FILENO);
@@ -257,6 +563,7 @@ void handle_redirection(struct redirection_t *r) {
             fd = fileno(fopen(r->file, "a+"));
             dup2(fd, STDOUT_FILENO);
             close(fd);
+            break;
         case RERR:
             fd = fileno(fopen(r->file, "w+"));
             dup2(fd, STDERR_FILENO);
@@ -265,14 +572,36 @@ void handle_redirection(struct redirection_t *r) {
     }
 }
 
+// A foreground job killed by one of its limits says which one
+static void report_limit_hit(Job job) {
+    char limit[64];
+    int hit = limit_hit(&job->limits, job->status, limit, sizeof(limit));
+
+    if (hit == LIMIT_NONE)
+        return;
+    set_color(RED);
+    term_printf("[%d] %d %skilled by the %s limit\n", job->jid,
+                (int) job->pid, hit == LIMIT_LIKELY ? "likely " : "", limit);
+    set_color(NONE);
+}
+
 void put_in_foreground(Job job) {
+    // Without a terminal there is nothing to hand over, just wait
+    if (!shell_is_interactive) {
+        job->is_foreground = TRUE;
+        wait_job(job);
+        report_limit_hit(job);
+        return;
+    }
+
     // Pass the control of the terminal to the child
     if (tcsetpgrp (shell_terminal, job->pid)== -1){
-        printf("ERROR: unable to pass control to the child\n");
+        term_printf("ERROR: unable to pass control to the child\n");
     }
 
     job->is_foreground = TRUE;
     wait_job(job);
+    report_limit_hit(job);
 
     // Give back the control to the current process
     // Put the shell back in the foreground
@@ -285,12 +614,15 @@ void put_in_foreground(Job job) {
 
 // Wait for a job to terminate or be stopped
 void wait_job(Job job) {
+    term_flush();
     exc_foreground = TRUE;
     // WUNTRACED is used so the waitpid will also
     // return if the process is stopped
-    waitpid(job->pid, &job->status, WUNTRACED);
+    while (capture_waitpid(job->pid, &job->status, WUNTRACED) < 0 &&
+           errno == EINTR);
     if (!WIFSTOPPED(job->status)) {
         invalidate_job(job);
+        reap_job_subs(job, 0);
     }
     exc_foreground = FALSE;
 }
@@ -298,20 +630,67 @@ void wait_job(Job job) {
 char execute_cmd(Command cmd) {
     #ifdef DEBUG
         set_color(RGREEN);
-        printf ("Executing ");
+        term_printf("Executing ");
         set_color(GREEN);
         print_cmd(cmd);
         set_color(RGREEN);
-        printf("...\n");
+        term_printf("...\n");
     #endif
 
     set_color(WHITE);
 
+    // Expand parameters and arithmetic before any word is interpreted.
+    // A failed expansion fails the line, substitutions included
+    subst_status = -1;
+    if (expand_cmd(cmd) == INVALID) {
+        last_status = 1;
+        free_cmd(&cmd);
+        return SUCCESS;
+    }
+
+    return run_pipeline(cmd);
+}
+
+// Runs an already expanded command line, splitting it on pipes
+char run_pipeline(Command cmd) {
     // Handle pipes
     int pipes_count = count_pipes(cmd), i, in = 0, fd[2];
     char action = SUCCESS;
+    Command *pipe_cmds, last;
+    Job *jobs;
+    Capture capture = NULL;
+    int out = STDOUT_FILENO, err = STDERR_FILENO;
 
-    Command* pipe_cmds = break_into_commands(cmd, pipes_count);
+    // A pipe with no command on one of its sides
+    if (pipes_count < 0) {
+        set_color(RED);
+        term_printf("ERROR: syntax error near unexpected token `|'\n");
+        set_color(NONE);
+        free_cmd(&cmd);
+        last_status = 2;
+        return SUCCESS;
+    }
+
+    pipe_cmds = break_into_commands(cmd, pipes_count);
+    last = pipe_cmds[pipes_count];
+    jobs = (Job *) calloc(pipes_count + 1, sizeof(Job));
+
+    // Builtins succeed unless they say otherwise
+    last_status = 0;
+    metrics_pipeline(pipes_count + 1);
+
+    // Captured background output goes through a pipe into a ring buffer
+    // the shell drains, never to the terminal
+    if (!is_foreground(last) &&
+        (is_captured(last) || (shell_options & OPT_CAPTURE))) {
+        if ((capture = open_capture(&err))) {
+            out = err;
+        } else {
+            set_color(RED);
+            term_printf("ERROR: too many captured jobs, output not captured\n");
+            set_color(NONE);
+        }
+    }
 
     for (i = 0; i < pipes_count + 1; i++) {
         // Only execute internal if there are no pipes
@@ -319,51 +698,248 @@ char execute_cmd(Command cmd) {
             // Try to execute as internal, launch an external job otherwise
             if ((!(action = try_internal_cmd(pipe_cmds[i])) && action != QUIT)) {
 
-                launch_job(pipe_cmds[i], is_foreground(pipe_cmds[i]), 0, 1);
+                jobs[i] = launch_job(pipe_cmds[i], is_foreground(pipe_cmds[i]),
+                                     0, out, err);
 
             } else {
-                Job new_job = (Job) malloc(sizeof(struct job));
-
-                // Add the job into the job list
-                add_job(job_list, new_job);
-
-                // Set is parameters
-                new_job->cmd = pipe_cmds[i];
-                new_job->pid = -1;
-                new_job->jid = job_list->jid_count;
-                new_job->status = -1;
-                new_job->is_valid = INVALID;
+                METRIC_INC(builtins);
+                record_internal_job(pipe_cmds[i]);
             }
         }
         else {
             // First from the last but one
             if (i < pipes_count) {
-                pipe(fd);
-                launch_job(pipe_cmds[i], is_foreground(pipe_cmds[i]),
-                           in, fd[1]);
+                pipe2(fd, O_CLOEXEC);
+                jobs[i] = launch_job(pipe_cmds[i], is_foreground(pipe_cmds[i]),
+                                     in, fd[1], err);
                 close (fd [1]);
+                if (in != 0)
+                    close (in);
                 in = fd [0];
             } else {
-                //dup2(fd[1], 1);
-                launch_job(pipe_cmds[i], is_foreground(pipe_cmds[i]),
-                           in, 1);
+                // A builtin ending the pipeline runs in the shell itself,
+                // reading the pipe it owns exclusively with a block
+                // buffered reader
+                Reader prev = stdin_reader;
+                int saved = dup(STDIN_FILENO);
+
+                dup2(in, STDIN_FILENO);
+                stdin_reader = open_reader(STDIN_FILENO, RD_BUFFERED);
+                action = try_internal_cmd(pipe_cmds[i]);
+                close_reader(stdin_reader);
+                stdin_reader = prev;
+                dup2(saved, STDIN_FILENO);
+                close(saved);
+
+                if (action == FAIL)
+                    jobs[i] = launch_job(pipe_cmds[i],
+                                         is_foreground(pipe_cmds[i]), in, out,
+                                         err);
+                else {
+                    METRIC_INC(builtins);
+                    record_internal_job(pipe_cmds[i]);
+                }
+                close (in);
             }
         }
     }
 
+    // The buffer belongs to the last stage, joblog finds it by its jid
+    if (capture) {
+        close(err);
+        if (jobs[pipes_count]) {
+            jobs[pipes_count]->capture = capture;
+            set_color(BLUE);
+            term_printf("[%d] %d, output captured\n", jobs[pipes_count]->jid,
+                   (int) jobs[pipes_count]->pid);
+            set_color(NONE);
+        } else {
+            close_capture(capture);
+        }
+    }
+
+    // Wait for every stage once the whole pipeline is running
+    for (i = 0; i < pipes_count + 1; i++) {
+        if (jobs[i] && is_foreground(last))
+            put_in_foreground(jobs[i]);
+    }
+
+    // The last stage decides $?, a background pipeline sets $! instead
+    if (jobs[pipes_count] && is_foreground(last))
+        last_status = exit_code(jobs[pipes_count]->status);
+    else if (jobs[pipes_count])
+        last_bg_pid = jobs[pipes_count]->pid;
+    free(jobs);
+    free(pipe_cmds);
+
+    return action;
+}
+
+// Keeps a builtin in the job list, so it shows up in the history
+void record_internal_job(Command cmd) {
+    Job new_job = (Job) malloc(sizeof(struct job));
+
+    // Add the job into the job list
+    add_job(job_list, new_job);
+
+    // Set is parameters
+    new_job->cmd = cmd;
+    new_job->subs = NULL;
+    new_job->nsubs = 0;
+    new_job->capture = NULL;
+    new_job->deadline = 0;
+    new_job->timed_out = 0;
+    new_job->waited_on = FALSE;
+    new_job->limits.set = 0;
+    new_job->pid = -1;
+    new_job->jid = job_list->jid_count;
+    new_job->status = -1;
+    new_job->is_valid = INVALID;
+}
+
+// Runs a command in a forked child and never returns. Simple commands
+// replace the child directly, pipelines are run by the child as a subshell
+void run_subshell(Command cmd) {
+    if (count_pipes(cmd) == 0) {
+        if (try_internal_cmd(cmd) != FAIL) {
+            term_flush();
+            _exit(last_status);
+        }
+        exec_job(cmd, TRUE, 0, 1);
+    }
+    run_pipeline(cmd);
+    term_flush();
+    _exit(last_status);
+}
+
+// Builtins that only print, the ones a substitution may run inside the
+// shell. Any other changes the shell's state, or reads its input, and so
+// runs in a subshell like an external command
+static int is_pure_builtin(const char *name) {
+    static const char *pure[] = { "history", "jobs", "joblog", "stats" };
+    size_t i;
+
+    for (i = 0; i < sizeof(pure) / sizeof(pure[0]); i++) {
+        if (!strcmp(name, pure[i]))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+// Appends the output of a builtin to the buffer. stdout is pointed at an
+// in-memory file while the builtin runs, so nothing is forked and large
+// outputs cannot fill a pipe the shell itself would have to drain
+static char capture_internal_cmd(Command cmd, struct strbuf *sb) {
+    int saved, mem = memfd_create("subst", MFD_CLOEXEC);
+    char action;
+    ssize_t n;
+    off_t off = 0;
+
+    if (mem < 0)
+        return FAIL;
+
+    term_flush();
+    saved = dup(STDOUT_FILENO);
+    dup2(mem, STDOUT_FILENO);
+
+    action = try_internal_cmd(cmd);
+
+    term_flush();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    if (action != FAIL) {
+        do {
+            sb_reserve(sb, SUBST_CHUNK);
+            n = pread(mem, sb->str + sb->len, sb->cap - sb->len - 1, off);
+            if (n > 0) {
+                sb->len += n;
+                off += n;
+            }
+        } while (n > 0 || (n < 0 && errno == EINTR));
+        sb->str[sb->len] = 0;
+    }
+    close(mem);
     return action;
 }
 
+// Command substitution: runs the command line and appends its output to
+// the buffer with trailing newlines stripped. Builtins that only print
+// run in-process, anything else is forked with its stdout read back
+// through a pipe
+int run_substitution(struct strbuf *sb, const char *str, size_t n) {
+    char *line = (char *) malloc(n + 2);
+    size_t start = sb->len;
+    Command cmd;
+    int fd[2], status;
+    ssize_t r;
+    pid_t pid, waited;
+
+    memcpy(line, str, n);
+    line[n] = '\n';
+    line[n + 1] = 0;
+    cmd = parse(line);
+    free(line);
+
+    sb_putn(sb, "", 0);
+    if (!cmd)
+        return EXPAND_OK;
+
+    // Inner expansions happen here, in the shell, before anything forks
+    if (expand_cmd(cmd) == INVALID) {
+        free_cmd(&cmd);
+        return EXPAND_ERROR;
+    }
+
+    if (count_pipes(cmd) != 0 || !is_pure_builtin(get_cmd_name(cmd)) ||
+        capture_internal_cmd(cmd, sb) == FAIL) {
+        if (pipe2(fd, O_CLOEXEC) == -1) {
+            free_cmd(&cmd);
+            return EXPAND_ERROR;
+        }
+
+        term_flush();
+        if ((pid = fork()) == 0) {
+            dup2(fd[1], STDOUT_FILENO);
+            run_subshell(cmd);
+        }
+        if (pid > 0)
+            METRIC_INC(forks);
+        close(fd[1]);
+
+        // Read straight into the result, growing it geometrically
+        do {
+            sb_reserve(sb, SUBST_CHUNK);
+            r = read(fd[0], sb->str + sb->len, sb->cap - sb->len - 1);
+            if (r > 0) sb->len += r;
+        } while (r > 0 || (r < 0 && errno == EINTR));
+        sb->str[sb->len] = 0;
+        close(fd[0]);
+
+        while (pid > 0 && (waited = waitpid(pid, &status, 0)) < 0 &&
+               errno == EINTR);
+        if (pid > 0 && waited == pid)
+            last_status = subst_status = exit_code(status);
+    }
+    free_cmd(&cmd);
+
+    while (sb->len > start && sb->str[sb->len - 1] == '\n')
+        sb->len--;
+    sb->str[sb->len] = 0;
+    return EXPAND_OK;
+}
+
 char update_jobs_status_cmd() {
     Jobl_tail tail = job_list->head;
 
     set_color(BLUE);
-    printf("JID\tPID\tSTATUS   \tCOMMAND\n");
+    term_printf("JID\tPID\tSTATUS   \tCOMMAND\n");
 
     // While there are items on the list
     while(tail) {
         Job item = tail->item;
-        int r_pid;
+        char limit[64];
+        int r_pid, hit;
 
         if (item->is_valid == VALID) {
             // Get the status related tot he process id
@@ -373,26 +949,38 @@ char update_jobs_status_cmd() {
             if (r_pid < 0) {
                 // Invalidate job
                 invalidate_job(item);
+                reap_job_subs(item, WNOHANG);
             }
             // The process exists and had its state changed
             else {
-                printf("%d\t%d\t", item->jid, (int) item->pid);
+                term_printf("%d\t%d\t", item->jid, (int) item->pid);
                 if (WIFEXITED(item->status)) {
-                    printf("Exited   \t");
+                    term_printf("Exited   \t");
+                    invalidate_job(item);
                 }
                 else if (WIFSIGNALED(item->status)) {
-                    printf("Killed   \t");
+                    term_printf("Killed   \t");
+                    invalidate_job(item);
                 }
                 else if (WIFSTOPPED(item->status)) {
-                    printf("Stopped  \t");
+                    term_printf("Stopped  \t");
                 }
                 else if (WIFCONTINUED(item->status)) {
-                    printf("Continued\t");
+                    term_printf("Continued\t");
                 }
                 else {
-                    printf("Running  \t");
+                    term_printf("Running  \t");
                 }
-                print_cmd(item->cmd); printf("\n");
+                print_cmd(item->cmd);
+                if (item->timed_out)
+                    term_printf(" [timed out, %s]", strsignal(item->timed_out));
+                if ((hit = limit_hit(&item->limits, item->status, limit,
+                                     sizeof(limit))))
+                    term_printf(hit == LIMIT_LIKELY ? " [likely %s limit]"
+                                                    : " [%s limit]", limit);
+                if (job_time_left(item) >= 0)
+                    term_printf(" [%.1fs left]", job_time_left(item));
+                term_printf("\n");
             }
         }
         tail = tail->next;
@@ -403,18 +991,37 @@ char update_jobs_status_cmd() {
 void terminate_foreground(int signo) {
     Jobl_tail tail = job_list->head;
 
-    // Look for foreground process
+    // Look for foreground process, each job leads its own group
     while(tail) {
         if(tail->item->is_valid &&
-           tail->item->is_foreground) {
-            kill(tail->item->pid, SIGINT);
-            invalidate_job(tail->item);
-        }
+           tail->item->is_foreground)
+            kill(-tail->item->pid, SIGINT);
         tail = tail->next;
     }
 
+    fg_interrupted = TRUE;
     if (!exc_foreground)
-        print_layout();
+        prompt_lost = TRUE;
+}
+
+// Reaps the foreground jobs a Ctrl-C ended while nothing waited for them.
+// One still on its way out is left to the next jobs listing
+static void reap_interrupted() {
+    Jobl_tail tail;
+    int status;
+
+    if (!fg_interrupted)
+        return;
+    fg_interrupted = FALSE;
+
+    for (tail = job_list->head; tail; tail = tail->next) {
+        if (tail->item->is_valid != VALID || !tail->item->is_foreground ||
+            waitpid(tail->item->pid, &status, WNOHANG) != tail->item->pid)
+            continue;
+        tail->item->status = status;
+        invalidate_job(tail->item);
+        reap_job_subs(tail->item, WNOHANG);
+    }
 }
 
 void stop_foreground(int signo) {
@@ -431,15 +1038,16 @@ void stop_foreground(int signo) {
     }
 
     if (!exc_foreground)
-        print_layout();
+        prompt_lost = TRUE;
 }
 
 char cd_cmd(Command cmd) {
     char **args = get_cmd_args(cmd);
 
-    // Try to change directory
+    // Try to change directory, a directory may be named like an operator
+    unmark_operators(cmd);
     if (chdir(args[1]) == -1) {
-        printf("cd: \"%s\": No such file or directory\n", args[1]);
+        term_printf("cd: \"%s\": No such file or directory\n", args[1]);
         return SUCCESS;
     }
 
@@ -452,12 +1060,12 @@ char history_cmd() {
     int       i    = 1;
 
     set_color(BLUE);
-    printf("BASH HISTORY\n");
+    term_printf("BASH HISTORY\n");
     while(tail) {
         Job item = tail->item;
-        printf("%d\t", i++);
+        term_printf("%d\t", i++);
         print_cmd(item->cmd);
-        printf("\n");
+        term_printf("\n");
         tail = tail->next;
     }
     return SUCCESS;
@@ -466,13 +1074,965 @@ char history_cmd() {
 char quit_cmd(Command cmd) {
     if (get_cmd_argc(cmd) != 1) {
         set_color(RED);
-        printf("ERROR: quit must have no parameters\n");
+        term_printf("ERROR: quit must have no parameters\n");
         set_color(NONE);
         return SUCCESS;
     }
     return QUIT;
 }
 
+// Returns whether the word has the NAME=value form
+char is_assignment(const char *word) {
+    int i;
+
+    if (!(isalpha((unsigned char) word[0]) || word[0] == '_'))
+        return FALSE;
+    for (i = 1; isalnum((unsigned char) word[i]) || word[i] == '_'; i++);
+    return word[i] == '=';
+}
+
+// Assigns shell variables. Variables live in the environment, so they
+// are visible to expansions and inherited by every launched job
+char assign_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    int i;
+
+    for (i = 0; args[i]; i++) {
+        if (!is_assignment(args[i]))
+            return FAIL;
+    }
+
+    for (i = 0; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+
+        *eq = 0;
+        setenv(args[i], eq + 1, 1);
+        *eq = '=';
+    }
+    if (subst_status >= 0)
+        last_status = subst_status;
+    return SUCCESS;
+}
+
+// set -o NAME enables an option, set +o NAME disables it and set -o
+// alone lists them
+char set_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    int i, n = sizeof(option_names) / sizeof(option_names[0]);
+
+    if (get_cmd_argc(cmd) <= 2) {
+        set_color(BLUE);
+        for (i = 0; i < n; i++) {
+            term_printf("%s\t%s\n", option_names[i].name,
+                   shell_options & option_names[i].flag ? "on" : "off");
+        }
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!strcmp(args[2], option_names[i].name))
+            break;
+    }
+
+    if (get_cmd_argc(cmd) != 3 || i == n ||
+        (strcmp(args[1], "-o") && strcmp(args[1], "+o"))) {
+        set_color(RED);
+        term_printf("ERROR: expecting set <-o || +o> <option>\n");
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    if (args[1][0] == '-')
+        shell_options |= option_names[i].flag;
+    else
+        shell_options &= ~option_names[i].flag;
+    return SUCCESS;
+}
+
+// Whether line[k] separates fields. Escaped characters never do
+static int is_ifs(const char *ifs, const char *line, const char *escaped,
+                  size_t k, int whitespace) {
+    if (escaped[k] || !strchr(ifs, line[k]))
+        return FALSE;
+    return !whitespace || strchr(" \t\n", line[k]);
+}
+
+// Assigns the fields of a line read by the read builtin. Fields are
+// separated by IFS characters and the last name gets the rest of the line
+static void assign_fields(char **names, const char *line,
+                          const char *escaped, size_t len) {
+    const char *ifs = getenv("IFS");
+    struct strbuf field = { NULL, 0, 0 };
+    size_t i = 0, end;
+
+    if (!ifs) ifs = " \t\n";
+
+    for (; *names; names++) {
+        field.len = 0;
+        sb_putn(&field, "", 0);
+
+        // Leading IFS whitespace is never part of a field
+        while (i < len && is_ifs(ifs, line, escaped, i, TRUE)) i++;
+
+        if (!names[1]) {
+            // Last name: the remainder, without trailing IFS whitespace
+            for (end = len;
+                 end > i && is_ifs(ifs, line, escaped, end - 1, TRUE); end--);
+            sb_putn(&field, &line[i], end - i);
+        }
+        else {
+            for (; i < len && !is_ifs(ifs, line, escaped, i, FALSE); i++)
+                sb_putn(&field, &line[i], 1);
+
+            // Skip the separator: whitespace around at most one other
+            // IFS character
+            while (i < len && is_ifs(ifs, line, escaped, i, TRUE)) i++;
+            if (i < len && is_ifs(ifs, line, escaped, i, FALSE)) i++;
+        }
+        setenv(*names, field.str, 1);
+    }
+    free(field.str);
+}
+
+// read [-r] [-d delim] [-n nchars] [-u fd] [name ...]
+// Reads one record through the descriptor's shared reader, so stdin
+// owned by the shell is read a block at a time rather than a byte
+char read_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd), **names, no_names[] = "REPLY";
+    char *reply[] = { no_names, NULL };
+    struct strbuf line = { NULL, 0, 0 }, escaped = { NULL, 0, 0 };
+    int i, c, raw = FALSE, delim = '\n', fd = STDIN_FILENO, opened = -1;
+    long nchars = -1;
+    struct redirection_t *r;
+    Reader reader;
+
+    // A builtin gets no redirection from exec_job, read handles its own.
+    // The file is owned by this read alone, so it is block buffered
+    if ((r = extract_redirection(cmd, "<", RIN))) {
+        opened = fd = open(r->file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            set_color(RED);
+            term_printf("read: \"%s\": No such file or directory\n", r->file);
+            set_color(NONE);
+            free_redirection(r);
+            return SUCCESS;
+        }
+        free_redirection(r);
+    }
+
+    for (i = 1; args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "-r"))
+            raw = TRUE;
+        else if (!strcmp(args[i], "-d") && args[i + 1])
+            delim = (unsigned char) args[++i][0];
+        else if (!strcmp(args[i], "-n") && args[i + 1])
+            nchars = atol(args[++i]);
+        else if (!strcmp(args[i], "-u") && args[i + 1] && opened < 0)
+            fd = atoi(args[++i]);
+        else {
+            set_color(RED);
+            term_printf("ERROR: expecting read [-r] [-d delim] [-n nchars] "
+                   "[-u fd] [name ...]\n");
+            set_color(NONE);
+            return SUCCESS;
+        }
+    }
+    names = args[i] ? &args[i] : reply;
+
+    reader = opened >= 0 ? open_reader(opened, RD_BUFFERED) : reader_for(fd);
+    if (!reader) {
+        set_color(RED);
+        term_printf("read: %d: invalid file descriptor\n", fd);
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    sb_putn(&line, "", 0);
+    if (raw && nchars < 0) {
+        // Fast path: the whole record is found with memchr in the buffer
+        if (reader_getdelim(reader, &line, delim) > 0 &&
+            line.str[line.len - 1] == (char) delim)
+            line.str[--line.len] = 0;
+        sb_reserve(&escaped, line.len);
+        memset(escaped.str, 0, line.len);
+    }
+    else {
+        reader_begin(reader);
+        while (nchars < 0 || (long) line.len < nchars) {
+            char ch, esc = FALSE;
+
+            if ((c = reader_getc(reader)) == EOF || c == delim)
+                break;
+
+            // Backslash escapes the next character and joins lines
+            if (!raw && c == '\\') {
+                if ((c = reader_getc(reader)) == EOF)
+                    break;
+                if (c == '\n')
+                    continue;
+                esc = TRUE;
+            }
+            ch = c;
+            sb_putn(&line, &ch, 1);
+            sb_putn(&escaped, &esc, 1);
+        }
+        reader_publish(reader);
+        sb_reserve(&escaped, 0);
+    }
+
+    if (names == reply)
+        setenv("REPLY", line.str, 1);
+    else
+        assign_fields(names, line.str, escaped.str, line.len);
+
+    if (opened >= 0) {
+        close_reader(reader);
+        close(opened);
+    }
+    free(line.str);
+    free(escaped.str);
+    return SUCCESS;
+}
+
+// Bytes left for the arguments of a new process: ARG_MAX minus what the
+// environment takes, each string counting its pointer and NUL too
+static long arg_space() {
+    extern char **environ;
+    long space = sysconf(_SC_ARG_MAX) - ARG_HEADROOM;
+    char **env;
+
+    for (env = environ; *env; env++)
+        space -= strlen(*env) + 1 + sizeof(char *);
+    return space;
+}
+
+// Waits for the first of the given jobs to end and removes it from the
+// array. Other children ending meanwhile have their job updated
+Job wait_any_job(Job *jobs, int n) {
+    int i, status;
+    pid_t pid;
+    Job found = NULL;
+
+    exc_foreground = TRUE;
+    while ((pid = capture_waitpid(-1, &status, 0)) > 0 || errno == EINTR) {
+        Job job;
+
+        if (pid < 0)
+            continue;
+        for (i = 0; i < n && jobs[i]->pid != pid; i++);
+
+        job = i < n ? jobs[i] : job_by_pid(pid);
+        if (job) {
+            job->status = status;
+            invalidate_job(job);
+            reap_job_subs(job, WNOHANG);
+        }
+        if (i < n) {
+            jobs[i] = jobs[n - 1];
+            found = job;
+            break;
+        }
+    }
+    exc_foreground = FALSE;
+    return found;
+}
+
+// Launches one batch, first waiting for a slot when procs are running.
+// When no child is left to wait for, the running ones were reaped
+// elsewhere and every slot is free. *failed is set once a batch fails
+static void run_batch(Command batch, Job *running, int *nrunning, int procs,
+                      int in, int out, int *failed) {
+    Job job;
+    int i;
+
+    if (*nrunning == procs) {
+        if ((job = wait_any_job(running, *nrunning))) {
+            (*nrunning)--;
+            *failed |= exit_code(job->status) != 0;
+        } else {
+            for (i = 0; i < *nrunning; i++)
+                *failed |= exit_code(running[i]->status) != 0;
+            *nrunning = 0;
+        }
+    }
+
+    // Interrupted while waiting for the slot
+    if (fg_interrupted) {
+        free_cmd(&batch);
+        return;
+    }
+
+    job = launch_job(batch, procs == 1, in, out, STDERR_FILENO);
+    if (procs == 1) {
+        put_in_foreground(job);
+        *failed |= exit_code(job->status) != 0;
+        return;
+    }
+
+    // Parallel batches run without the terminal, but Ctrl-C still
+    // reaches them as it does any foreground job
+    job->is_foreground = TRUE;
+    running[(*nrunning)++] = job;
+}
+
+// xargs [-0] [-n max] [-P procs] [cmd [args ...]] [< file]
+// Reads items from stdin and runs the command with as many of them as
+// ARG_MAX allows, up to procs batches at a time. Batches are launched
+// from the shell, so there is no separate xargs process in between. $?
+// is 123 when a batch failed, as with xargs, and Ctrl-C stops it all
+char xargs_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd), *echo_args[] = { "echo", NULL };
+    char **base, *item, *next;
+    struct strbuf line = { NULL, 0, 0 };
+    long space, used = 0, max_items = LONG_MAX, items = 0;
+    int i, procs = 1, nrunning = 0, nul = FALSE, in, out = STDOUT_FILENO;
+    int opened = -1, failed = FALSE;
+    Command batch = NULL;
+    Reader reader;
+    struct redirection_t *r;
+    Job *running;
+
+    // A builtin gets no redirection from exec_job. The items may come
+    // from a file of xargs' own
+    if ((r = extract_redirection(cmd, "<", RIN))) {
+        opened = open(r->file, O_RDONLY | O_CLOEXEC);
+        if (opened < 0) {
+            set_color(RED);
+            term_printf("xargs: \"%s\": No such file or directory\n",
+                        r->file);
+            set_color(NONE);
+            free_redirection(r);
+            last_status = 1;
+            return SUCCESS;
+        }
+        free_redirection(r);
+    }
+    reader = opened >= 0 ? open_reader(opened, RD_BUFFERED)
+                         : reader_for(STDIN_FILENO);
+
+    // Output redirection applies to xargs as a whole, not to each batch
+    if ((r = extract_redirection(cmd, ">", ROUT)) ||
+        (r = extract_redirection(cmd, ">>", ROUT_APPEND))) {
+        out = open(r->file, O_WRONLY | O_CREAT | O_CLOEXEC |
+                   (r->type == ROUT ? O_TRUNC : O_APPEND), 0666);
+        free_redirection(r);
+        if (out < 0) {
+            set_color(RED);
+            term_printf("ERROR: unable to open the output of xargs\n");
+            set_color(NONE);
+            goto done;
+        }
+    }
+
+    for (i = 1; args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "-0"))
+            nul = TRUE;
+        else if (!strcmp(args[i], "-n") && args[i + 1])
+            max_items = atol(args[++i]);
+        else if (!strcmp(args[i], "-P") && args[i + 1])
+            procs = atoi(args[++i]);
+        else
+            break;
+    }
+    if (max_items <= 0 || procs <= 0 || (args[i] && args[i][0] == '-')) {
+        set_color(RED);
+        term_printf("ERROR: expecting xargs [-0] [-n max] [-P procs] "
+               "[cmd [args ...]] [< file]\n");
+        set_color(NONE);
+        goto done;
+    }
+    base = args[i] ? &args[i] : echo_args;
+
+    // Room left once the command itself is in place
+    space = arg_space();
+    for (i = 0; base[i]; i++)
+        space -= strlen(base[i]) + 1 + sizeof(char *);
+
+    // Batches must not compete with us for the item stream
+    in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    running = (Job *) malloc(procs * sizeof(Job));
+    fg_interrupted = FALSE;
+
+    while (reader && !fg_interrupted && (line.len = 0,
+                      reader_getdelim(reader, &line, nul ? 0 : '\n') > 0)) {
+        if (line.str[line.len - 1] == (nul ? 0 : '\n'))
+            line.str[--line.len] = 0;
+
+        // Blank separated items, or the whole record with -0
+        for (item = line.str; item; item = next) {
+            size_t len;
+
+            if (nul) {
+                next = NULL;
+            }
+            else {
+                item += strspn(item, " \t");
+                if (!*item) break;
+                next = item + strcspn(item, " \t");
+                if (*next) *next++ = 0;
+                else next = NULL;
+            }
+            len = strlen(item) + 1 + sizeof(char *);
+
+            // No command could take it, exec would fail with E2BIG
+            if (strlen(item) + 1 > (size_t) ARG_STRLEN_MAX ||
+                (long) len > space) {
+                set_color(RED);
+                term_printf("ERROR: xargs: skipping an item of %zu bytes, "
+                            "longer than an argument may be\n",
+                            strlen(item));
+                set_color(NONE);
+                continue;
+            }
+
+            if (batch && (items == max_items || used + (long) len > space)) {
+                run_batch(batch, running, &nrunning, procs, in, out, &failed);
+                batch = NULL;
+                if (fg_interrupted)
+                    break;
+            }
+            if (!batch) {
+                batch = new_command();
+                for (i = 0; base[i]; i++)
+                    push_arg(batch, strdup(base[i]));
+                used = 0;
+                items = 0;
+            }
+            // An item is never an operator of the batch
+            push_arg(batch, is_operator(item) ? mark_operator(strdup(item))
+                                              : strdup(item));
+            used += len;
+            items++;
+        }
+    }
+    if (batch && !fg_interrupted)
+        run_batch(batch, running, &nrunning, procs, in, out, &failed);
+    else if (batch)
+        free_cmd(&batch);
+
+    // A child reaped elsewhere left its status in its job
+    for (; nrunning > 0; nrunning--) {
+        Job job = wait_any_job(running, nrunning);
+
+        if (!job) {
+            for (i = 0; i < nrunning; i++)
+                failed |= exit_code(running[i]->status) != 0;
+            break;
+        }
+        failed |= exit_code(job->status) != 0;
+    }
+    last_status = fg_interrupted ? 128 + SIGINT : failed ? 123 : 0;
+
+    close(in);
+    free(running);
+    free(line.str);
+done:
+    if (out >= 0 && out != STDOUT_FILENO)
+        close(out);
+    if (opened >= 0) {
+        close_reader(reader);
+        close(opened);
+    }
+    return SUCCESS;
+}
+
+// Parses a duration such as 10, 2.5s, 1m, 3h or 1d into seconds
+static int parse_duration(const char *str, double *secs) {
+    char *end;
+
+    *secs = strtod(str, &end);
+    if (end == str || *secs < 0)
+        return FALSE;
+
+    // Each unit falls through to the smaller ones
+    switch (*end) {
+        case 'd': *secs *= 24;
+        case 'h': *secs *= 60;
+        case 'm': *secs *= 60;
+        case 's': end++;
+        case 0:   break;
+        default:  return FALSE;
+    }
+    return *end == 0;
+}
+
+// Parses a signal given by number, name or SIG-prefixed name
+static int parse_signal(const char *str) {
+    static const struct {
+        const char *name;
+        int        sig;
+    } names[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+        {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+        {"ALRM", SIGALRM}, {"TERM", SIGTERM}
+    };
+    int i;
+
+    if (isdigit((unsigned char) str[0]))
+        return atoi(str) > 0 && atoi(str) < NSIG ? atoi(str) : -1;
+    if (!strncmp(str, "SIG", 3))
+        str += 3;
+    for (i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        if (!strcmp(str, names[i].name))
+            return names[i].sig;
+    }
+    return -1;
+}
+
+// timeout [-s SIG] [-k KILLAFTER] DURATION cmd runs cmd as a job with a
+// deadline. Once it passes, SIG (TERM by default) goes to the job's
+// process group, then SIGKILL KILLAFTER later
+char timeout_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    double duration, kill_after = DEFAULT_KILL_AFTER;
+    int i, sig = SIGTERM, valid = TRUE;
+    Command inner;
+    Job job;
+
+    for (i = 1; valid && args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "-s") && args[i + 1])
+            valid = (sig = parse_signal(args[++i])) > 0;
+        else if (!strcmp(args[i], "-k") && args[i + 1])
+            valid = parse_duration(args[++i], &kill_after);
+        else
+            valid = FALSE;
+    }
+    if (!valid || !args[i] || !parse_duration(args[i], &duration) ||
+        !args[i + 1] || !strcmp(args[i + 1], "&")) {
+        set_color(RED);
+        term_printf("ERROR: expecting timeout [-s SIG] [-k KILLAFTER] DURATION "
+               "cmd\n");
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    inner = new_command();
+    for (i++; args[i]; i++)
+        push_arg(inner, strdup(args[i]));
+
+    job = launch_job(inner, is_foreground(inner), STDIN_FILENO,
+                     STDOUT_FILENO, STDERR_FILENO);
+    watch_job(job, duration, sig, kill_after);
+    if (!is_foreground(inner)) {
+        last_bg_pid = job->pid;
+        return SUCCESS;
+    }
+
+    // 124 when the command timed out, 137 if it had to be killed
+    put_in_foreground(job);
+    if (job->timed_out)
+        last_status = job->timed_out == SIGKILL ? 128 + SIGKILL : 124;
+    else
+        last_status = exit_code(job->status);
+
+    return SUCCESS;
+}
+
+// memo [-e VAR]... [-i FILE]... [-m FILE]... cmd replays the stdout,
+// stderr and status of an earlier run of cmd when its arguments, the
+// working directory, the listed variables and the input files (by content
+// with -i, by modification time with -m) are all unchanged. Otherwise cmd
+// runs and its output is stored on its way to the terminal
+char memo_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd), cwd[PATH_MAX], *buf, *value;
+    struct strbuf key = {NULL, 0, 0};
+    struct memo_header header;
+    struct memo_entry entry;
+    struct pollfd fds[2];
+    siginfo_t info;
+    int i, first, fd, open_fds, out[2], errp[2], caching, valid = TRUE;
+    ssize_t n;
+    Command inner;
+    Job job;
+
+    if (!getcwd(cwd, sizeof(cwd)))
+        cwd[0] = 0;
+    sb_putn(&key, "cwd ", 4);
+    sb_putn(&key, cwd, strlen(cwd) + 1);
+
+    for (i = 1; valid && args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "--")) {
+            i++;
+            break;
+        }
+        if (!args[i + 1]) {
+            valid = FALSE;
+        } else if (!strcmp(args[i], "-e")) {
+            // Unset and empty are different keys
+            value = getenv(args[++i]);
+            sb_putn(&key, value ? "env " : "unset ", value ? 4 : 6);
+            sb_putn(&key, args[i], strlen(args[i]) + 1);
+            if (value)
+                sb_putn(&key, value, strlen(value) + 1);
+        } else if (!strcmp(args[i], "-i") || !strcmp(args[i], "-m")) {
+            if (memo_add_file(&key, args[i + 1], args[i][1] == 'm') == -1) {
+                set_color(RED);
+                term_printf("ERROR: memo: cannot read %s\n", args[i + 1]);
+                set_color(NONE);
+                free(key.str);
+                return SUCCESS;
+            }
+            i++;
+        } else {
+            valid = FALSE;
+        }
+    }
+    if (!valid || !args[i] || !is_foreground(cmd)) {
+        set_color(RED);
+        term_printf("ERROR: expecting memo [-e VAR]... [-i FILE]... [-m FILE]... "
+               "cmd\n");
+        set_color(NONE);
+        free(key.str);
+        return SUCCESS;
+    }
+
+    sb_putn(&key, "argv ", 5);
+    for (first = i; args[i]; i++)
+        sb_putn(&key, args[i], strlen(args[i]) + 1);
+
+    if ((fd = memo_lookup(key.str, key.len, &header)) >= 0) {
+        last_status = memo_replay(fd, &header);
+        free(key.str);
+        return SUCCESS;
+    }
+
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        free(key.str);
+        return SUCCESS;
+    }
+    if (pipe2(errp, O_CLOEXEC) == -1) {
+        close(out[0]);
+        close(out[1]);
+        free(key.str);
+        return SUCCESS;
+    }
+
+    inner = new_command();
+    for (i = first; args[i]; i++)
+        push_arg(inner, strdup(args[i]));
+
+    term_flush();
+    job = launch_job(inner, TRUE, STDIN_FILENO, out[1], errp[1]);
+    close(out[1]);
+    close(errp[1]);
+    caching = memo_begin(&entry, key.str, key.len) == 0;
+
+    // Tee both streams to the terminal and the cache until the job closes
+    // them, each read kept as a chunk so a hit replays them interleaved
+    buf = (char *) malloc(SUBST_CHUNK);
+    fds[0].fd = out[0];
+    fds[1].fd = errp[0];
+    fds[0].events = fds[1].events = POLLIN;
+    for (open_fds = 2; open_fds > 0;) {
+        if ((n = poll(fds, 2, MEMO_POLL_MS)) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // A stopped job keeps its pipes open, stop reading and caching
+        // and let it be handled as any other stopped job
+        if (n == 0) {
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PID, job->pid, &info,
+                       WSTOPPED | WNOHANG | WNOWAIT) == 0 && info.si_pid)
+                break;
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents)
+                continue;
+            if ((n = read(fds[i].fd, buf, SUBST_CHUNK)) < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+                continue;
+            }
+            if (i == 0) {
+                term_write(buf, n);
+                term_flush();
+            } else {
+                write(STDERR_FILENO, buf, n);
+            }
+            if (caching)
+                memo_write(&entry, i == 0 ? STDOUT_FILENO : STDERR_FILENO,
+                           buf, n);
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0)
+            close(fds[i].fd);
+    }
+    free(buf);
+
+    // Only completed runs are cached, not ones stopped or killed
+    if (open_fds > 0 && caching) {
+        memo_abort(&entry);
+        caching = FALSE;
+    }
+    put_in_foreground(job);
+    last_status = exit_code(job->status);
+    if (caching && WIFEXITED(job->status))
+        memo_commit(&entry, last_status);
+    else if (caching)
+        memo_abort(&entry);
+
+    free(key.str);
+    return SUCCESS;
+}
+
+// stats [-p] prints the shell's counters, -p in the Prometheus text
+// format also written to $SHELL_METRICS_FILE
+char stats_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    int prometheus = args[1] && !strcmp(args[1], "-p");
+
+    if (args[1] && (!prometheus || args[2])) {
+        set_color(RED);
+        term_printf("ERROR: expecting stats [-p]\n");
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    metrics_print(prometheus);
+    return SUCCESS;
+}
+
+// ulimit [NAME=VALUE]... sets the limits every job starts with: as, core,
+// cpu, data, fsize, nofile, nproc and stack. unlimited drops a default.
+// Without arguments, lists them next to the shell's own limits
+char ulimit_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    struct job_limits limits = shell_limits;
+    const char *why;
+    int i;
+
+    if (!args[1]) {
+        print_limits(&shell_limits);
+        return SUCCESS;
+    }
+
+    // Nothing changes unless every word is right
+    for (i = 1; args[i]; i++) {
+        if ((why = parse_limit(args[i], &limits))) {
+            set_color(RED);
+            term_printf("ERROR: ulimit: %s: %s\n", args[i], why);
+            set_color(NONE);
+            return SUCCESS;
+        }
+    }
+    shell_limits = limits;
+    return SUCCESS;
+}
+
+// limit NAME=VALUE... [--] cmd runs cmd with more limits than the ulimit
+// defaults. A builtin passes them on to the jobs it launches
+char limit_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    struct job_limits limits = { 0 }, *saved = prefix_limits;
+    const char *why = NULL;
+    char action;
+    Command inner;
+    Job job;
+    int i;
+
+    // Nested limits add up
+    if (prefix_limits)
+        limits = *prefix_limits;
+    for (i = 1; !why && args[i] && strchr(args[i], '='); i++)
+        why = parse_limit(args[i], &limits);
+    if (why) {
+        set_color(RED);
+        term_printf("ERROR: limit: %s: %s\n", args[i - 1], why);
+        set_color(NONE);
+        return SUCCESS;
+    }
+    if (args[i] && !strcmp(args[i], "--"))
+        i++;
+    if (!args[i] || !strcmp(args[i], "&")) {
+        set_color(RED);
+        term_printf("ERROR: expecting limit NAME=VALUE... [--] cmd\n");
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    inner = new_command();
+    for (; args[i]; i++)
+        push_arg(inner, strdup(args[i]));
+
+    prefix_limits = &limits;
+    if ((action = try_internal_cmd(inner)) != FAIL) {
+        free_cmd(&inner);
+    } else {
+        job = launch_job(inner, is_foreground(inner), STDIN_FILENO,
+                         STDOUT_FILENO, STDERR_FILENO);
+        if (is_foreground(inner)) {
+            put_in_foreground(job);
+            last_status = exit_code(job->status);
+        } else {
+            last_bg_pid = job->pid;
+        }
+    }
+    prefix_limits = saved;
+
+    return action == QUIT ? QUIT : SUCCESS;
+}
+
+// joblog [-f] [-n lines] <jid> prints what a captured background job
+// wrote. -n keeps the last lines only, -f follows the output until the
+// job closes it or the user interrupts
+char joblog_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    int i, follow = FALSE, lines = -1;
+    uint64_t from = 0;
+    Job job;
+
+    for (i = 1; args[i] && args[i][0] == '-'; i++) {
+        if (!strcmp(args[i], "-f"))
+            follow = TRUE;
+        else if (!strcmp(args[i], "-n") && args[i + 1])
+            lines = atoi(args[++i]);
+        else
+            break;
+    }
+    if (!args[i] || args[i + 1] || args[i][0] == '-') {
+        set_color(RED);
+        term_printf("ERROR: expecting joblog [-f] [-n lines] <jid>\n");
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    job = get_job(-1, atoi(args[i][0] == '%' ? &args[i][1] : args[i]));
+    if (!job || !job->capture) {
+        set_color(RED);
+        term_printf("ERROR: no output captured for job %s\n", args[i]);
+        set_color(NONE);
+        return SUCCESS;
+    }
+
+    if (lines >= 0)
+        from = capture_tail(job->capture, lines);
+    from = capture_print(job->capture, from);
+
+    exc_foreground = TRUE;
+    while (follow && job->capture->fd >= 0 && capture_wait(-1) != CW_INTR)
+        from = capture_print(job->capture, from);
+    exc_foreground = FALSE;
+
+    return SUCCESS;
+}
+
+// wait [-n] [%jid | pid ...] blocks until the given background jobs, or
+// all of them, have finished; -n returns as soon as one of them has, and
+// with none to wait for fails with 127. Children are reaped as they change
+// state, nothing is polled, and each one is matched to its job through the
+// pid index, the jobs named being flagged
+char wait_cmd(Command cmd) {
+    char **args = get_cmd_args(cmd);
+    int i = 1, any = FALSE, ntargets = 0, pending = 0, status;
+    Job *targets = (Job *) malloc(get_cmd_argc(cmd) * sizeof(Job)), job;
+    struct sigaction sa, saved;
+    Jobl_tail tail;
+    pid_t pid;
+
+    if (args[1] && !strcmp(args[1], "-n")) {
+        any = TRUE;
+        i++;
+    }
+
+    last_status = 0;
+    for (; args[i]; i++) {
+        if (args[i][0] == '%')
+            job = get_job(-1, atoi(&args[i][1]));
+        else if (!(job = job_by_pid(atoi(args[i]))))
+            job = get_job(atoi(args[i]), -1);
+        if (!job || job->pid <= 0) {
+            set_color(RED);
+            term_printf("wait: %s: no such job\n", args[i]);
+            set_color(NONE);
+            last_status = 127;
+            continue;
+        }
+        targets[ntargets++] = job;
+
+        // With -n, a job that is already done answers right away
+        if (job->is_valid != VALID && any) {
+            last_status = exit_code(job->status);
+            break;
+        }
+        if (job->is_valid == VALID && !job->waited_on) {
+            job->waited_on = TRUE;
+            pending++;
+        }
+    }
+    if (args[i] || (i > (any ? 2 : 1) && ntargets == 0))
+        goto done;
+
+    // Without names, every running job is waited for
+    if (ntargets == 0) {
+        for (tail = job_list->head; tail; tail = tail->next) {
+            if (tail->item->is_valid == VALID && tail->item->pid > 0) {
+                tail->item->waited_on = TRUE;
+                pending++;
+            }
+        }
+    }
+    if (any && pending == 0) {
+        last_status = 127;
+        goto done;
+    }
+
+    // Unlike a foreground wait, Ctrl-C interrupts this one
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = terminate_foreground;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &saved);
+    exc_foreground = TRUE;
+
+    while (pending > 0) {
+        if ((pid = capture_waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR)
+                last_status = 128 + SIGINT;
+            break;
+        }
+
+        // Process substitutions and such are not jobs
+        if (!(job = job_by_pid(pid)))
+            continue;
+        job->status = status;
+        invalidate_job(job);
+        reap_job_subs(job, WNOHANG);
+
+        if (job->waited_on) {
+            job->waited_on = FALSE;
+            pending--;
+            if (any) {
+                last_status = exit_code(status);
+                break;
+            }
+        }
+    }
+
+    exc_foreground = FALSE;
+    sigaction(SIGINT, &saved, NULL);
+
+    // Without -n, the status is the one of the last job named
+    if (!any && pending == 0 && ntargets > 0 && last_status != 127)
+        last_status = exit_code(targets[ntargets - 1]->status);
+
+done:
+    // Jobs still flagged were not reaped, clear them for the next wait
+    for (i = 0; pending > 0 && i < ntargets; i++)
+        targets[i]->waited_on = FALSE;
+    for (tail = job_list->head; pending > 0 && !ntargets && tail;
+         tail = tail->next)
+        tail->item->waited_on = FALSE;
+    free(targets);
+    return SUCCESS;
+}
+
 Job get_job(int pid, int jid) {
     Jobl_tail tail = job_list->head;
 
@@ -500,7 +2060,8 @@ Job get_job(int pid, int jid) {
 char is_stopped(Job job) {
     int r_pid = waitpid(job->pid, &job->status, WUNTRACED | WNOHANG | WCONTINUED);
 
-    if (r_pid < 0) {
+    if (r_pid < 0 || (r_pid > 0 && (WIFEXITED(job->status) ||
+                                    WIFSIGNALED(job->status)))) {
         invalidate_job(job);
         return FALSE;
     }
@@ -526,7 +2087,7 @@ char bg_cmd(Command cmd) {
     // Handles incorrect input
     if (get_cmd_argc(cmd) != 2) {
         set_color(RED);
-        printf("ERROR: expecting bg <pid || %%jid>\n");
+        term_printf("ERROR: expecting bg <pid || %%jid>\n");
         set_color(NONE);
         return SUCCESS;
     }
@@ -542,7 +2103,7 @@ char bg_cmd(Command cmd) {
         // Check if the job is stopped
         if (!is_stopped(job)) {
             set_color(RED);
-            printf("ERROR: The process %d (%%%d) is not stopped\n",
+            term_printf("ERROR: The process %d (%%%d) is not stopped\n",
                    job->pid, job->jid);
             set_color(NONE);
             return SUCCESS;
@@ -552,12 +2113,12 @@ char bg_cmd(Command cmd) {
         kill(job->pid, SIGCONT);
 
         set_color(BLUE);
-        printf("Job %d (%%%d) continued in background...\n",
+        term_printf("Job %d (%%%d) continued in background...\n",
                job->pid, job->jid);
         set_color(NONE);
     } else {
         set_color(RED);
-        printf("ERROR: Job not found\n");
+        term_printf("ERROR: Job not found\n");
         set_color(NONE);
     }
 
@@ -571,7 +2132,7 @@ char fg_cmd(Command cmd) {
     // Handles incorrect input
     if (get_cmd_argc(cmd) != 2) {
         set_color(RED);
-        printf("ERROR: expecting fg <pid || %%jid>\n");
+        term_printf("ERROR: expecting fg <pid || %%jid>\n");
         set_color(NONE);
         return SUCCESS;
     }
@@ -589,7 +2150,7 @@ char fg_cmd(Command cmd) {
         // Check if the job is stopped
         if (job->is_valid == INVALID) {
             set_color(RED);
-            printf("ERROR: Job not found\n");
+            term_printf("ERROR: Job not found\n");
             set_color(NONE);
             return SUCCESS;
         }
@@ -598,14 +2159,14 @@ char fg_cmd(Command cmd) {
         kill(job->pid, SIGCONT);
 
         set_color(BLUE);
-        printf("Job %d (%%%d) continued in foreground...\n",
+        term_printf("Job %d (%%%d) continued in foreground...\n",
                job->pid, job->jid);
         set_color(NONE);
 
         put_in_foreground(job);
     } else {
         set_color(RED);
-        printf("ERROR: Job not found\n");
+        term_printf("ERROR: Job not found\n");
         set_color(NONE);
     }
 
@@ -638,6 +2199,50 @@ char try_internal_cmd(Command cmd) {
     else if(!strcmp(get_cmd_name(cmd), "fg")) {
         return fg_cmd(cmd);
     }
+    // Run a command over the items read from stdin
+    else if(!strcmp(get_cmd_name(cmd), "xargs")) {
+        return xargs_cmd(cmd);
+    }
+    // Read a line into variables
+    else if(!strcmp(get_cmd_name(cmd), "read")) {
+        return read_cmd(cmd);
+    }
+    // Run a command with a deadline
+    else if(!strcmp(get_cmd_name(cmd), "timeout")) {
+        return timeout_cmd(cmd);
+    }
+    // Wait for background jobs
+    else if(!strcmp(get_cmd_name(cmd), "wait")) {
+        return wait_cmd(cmd);
+    }
+    // Replay or cache a command's output
+    else if(!strcmp(get_cmd_name(cmd), "memo")) {
+        return memo_cmd(cmd);
+    }
+    // Shell counters
+    else if(!strcmp(get_cmd_name(cmd), "stats")) {
+        return stats_cmd(cmd);
+    }
+    // Default resource limits for jobs
+    else if(!strcmp(get_cmd_name(cmd), "ulimit")) {
+        return ulimit_cmd(cmd);
+    }
+    // Run a command with resource limits
+    else if(!strcmp(get_cmd_name(cmd), "limit")) {
+        return limit_cmd(cmd);
+    }
+    // Show the output captured from a background job
+    else if(!strcmp(get_cmd_name(cmd), "joblog")) {
+        return joblog_cmd(cmd);
+    }
+    // Shell options
+    else if(!strcmp(get_cmd_name(cmd), "set")) {
+        return set_cmd(cmd);
+    }
+    // Variable assignment (NAME=value ...)
+    else if(is_assignment(get_cmd_name(cmd))) {
+        return assign_cmd(cmd);
+    }
 
     return FAIL;
 }
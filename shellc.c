@@ -0,0 +1,212 @@
+// Client for the shell's --serve mode. Runs one command line on a
+// resident shell with this process' cwd and stdin/stdout/stderr:
+//
+//     shellc [-v] [-e NAME=value]... <socket> <command line>
+//
+// With -n count, the same request is sent count times over -c
+// connections and the rate is reported, as a load test of the server
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "serve.h"
+
+#define MAX_OVERRIDES 64
+
+static char   msg[SERVE_MAX_MSG];
+static size_t msg_len = 0;
+
+static void die(const char *what) {
+    fprintf(stderr, "shellc: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void pack(const char *str) {
+    size_t n = strlen(str) + 1;
+
+    if (msg_len + n > sizeof(msg)) {
+        fprintf(stderr, "shellc: request too large\n");
+        exit(1);
+    }
+    memcpy(&msg[msg_len], str, n);
+    msg_len += n;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die(path);
+    return fd;
+}
+
+// Sends the request with our stdin, stdout and stderr attached
+static void send_request(int fd) {
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { msg, msg_len };
+    struct msghdr hdr;
+    struct cmsghdr *cmsg;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memset(control, 0, sizeof(control));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &hdr, 0) == -1)
+        die("send");
+}
+
+static void recv_reply(int fd, struct serve_reply *reply) {
+    ssize_t n = recv(fd, reply, sizeof(*reply), 0);
+
+    if (n != sizeof(*reply)) {
+        if (n >= 0)
+            errno = ECONNRESET;
+        die("reply");
+    }
+    if (reply->error) {
+        errno = reply->error;
+        die("server");
+    }
+}
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Keeps conns requests in flight until count have been answered
+static void load_test(const char *path, long count, int conns) {
+    struct pollfd *pfds = (struct pollfd *) calloc(conns, sizeof(*pfds));
+    struct serve_reply reply;
+    long sent = 0, done = 0;
+    double start = now(), elapsed;
+    int i;
+
+    for (i = 0; i < conns && sent < count; i++, sent++) {
+        pfds[i].fd = connect_to(path);
+        pfds[i].events = POLLIN;
+        send_request(pfds[i].fd);
+    }
+    for (; i < conns; i++)
+        pfds[i].fd = -1;
+
+    while (done < count) {
+        if (poll(pfds, conns, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        for (i = 0; i < conns; i++) {
+            if (!pfds[i].revents)
+                continue;
+            recv_reply(pfds[i].fd, &reply);
+            done++;
+            if (sent < count) {
+                send_request(pfds[i].fd);
+                sent++;
+            } else {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+            }
+        }
+    }
+
+    elapsed = now() - start;
+    fprintf(stderr, "%ld requests over %d connections in %.3f s: %.0f req/s\n",
+            count, conns, elapsed, count / elapsed);
+    free(pfds);
+}
+
+int main(int argc, char **argv) {
+    struct serve_req req = { 0 };
+    struct serve_reply reply;
+    char cwd[PATH_MAX], *overrides[MAX_OVERRIDES];
+    long count = 1;
+    int conns = 1, verbose = 0, opt, i, fd;
+
+    while ((opt = getopt(argc, argv, "+ve:n:c:")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'e':
+                if (req.envc < MAX_OVERRIDES)
+                    overrides[req.envc++] = optarg;
+                break;
+            case 'n':
+                count = atol(optarg);
+                break;
+            case 'c':
+                conns = atoi(optarg);
+                break;
+            default:
+                argc = 0;
+        }
+    }
+    if (optind + 2 > argc || count < 1 || conns < 1) {
+        fprintf(stderr, "usage: shellc [-v] [-e NAME=value]... "
+                        "[-n count] [-c conns] <socket> <command line>\n");
+        return 2;
+    }
+
+    // Header, cwd, command line (remaining words joined), overrides
+    memcpy(msg, &req, sizeof(req));
+    msg_len = sizeof(req);
+    if (!getcwd(cwd, sizeof(cwd)))
+        die("getcwd");
+    pack(cwd);
+    for (i = optind + 1; i < argc; i++) {
+        pack(argv[i]);
+        if (i + 1 < argc)
+            msg[msg_len - 1] = ' ';
+    }
+    for (i = 0; i < (int) req.envc; i++)
+        pack(overrides[i]);
+
+    if (count > 1) {
+        load_test(argv[optind], count, conns);
+        return 0;
+    }
+
+    fd = connect_to(argv[optind]);
+    send_request(fd);
+    recv_reply(fd, &reply);
+    close(fd);
+
+    if (verbose)
+        fprintf(stderr, "status %d, user %ld.%06lds, sys %ld.%06lds, "
+                        "maxrss %ldK\n", reply.status,
+                (long) reply.usage.ru_utime.tv_sec,
+                (long) reply.usage.ru_utime.tv_usec,
+                (long) reply.usage.ru_stime.tv_sec,
+                (long) reply.usage.ru_stime.tv_usec,
+                reply.usage.ru_maxrss);
+
+    if (WIFSIGNALED(reply.status))
+        return 128 + WTERMSIG(reply.status);
+    return WEXITSTATUS(reply.status);
+}
@@ -0,0 +1,136 @@
+#define _GNU_SOURCE
+#include "watchdog.h"
+#include "capture.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+// Jobs with a deadline, and a single timerfd armed for the earliest one.
+// No watchdog process: the event loop polls the timer like any other fd
+static Job *watched = NULL;
+static int nwatched = 0, watched_cap = 0;
+static int timer = -1;
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Re-arms the timer for the earliest deadline, or disarms it
+static void arm() {
+    struct itimerspec its;
+    double next = 0;
+    int i;
+
+    for (i = 0; i < nwatched; i++) {
+        if (i == 0 || watched[i]->deadline < next)
+            next = watched[i]->deadline;
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (nwatched > 0) {
+        its.it_value.tv_sec = (time_t) next;
+        its.it_value.tv_nsec = (long) ((next - (time_t) next) * 1e9);
+        // An all zero value would disarm it
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Sends sig to the job's process group once duration seconds have
+// passed, then SIGKILL kill_after seconds later if it is still around
+void watch_job(Job job, double duration, int sig, double kill_after) {
+    if (timer < 0) {
+        timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer == -1 || event_loop_init() == -1)
+            return;
+    }
+
+    job->deadline = now() + duration;
+    job->timeout_sig = sig;
+    job->kill_after = kill_after;
+    job->timed_out = 0;
+
+    if (nwatched == watched_cap) {
+        watched_cap = watched_cap ? 2 * watched_cap : 16;
+        watched = (Job *) realloc(watched, watched_cap * sizeof(Job));
+    }
+    watched[nwatched++] = job;
+    arm();
+}
+
+void unwatch_job(Job job) {
+    int i;
+
+    if (job->deadline == 0)
+        return;
+    job->deadline = 0;
+
+    for (i = 0; i < nwatched && watched[i] != job; i++);
+    if (i < nwatched) {
+        watched[i] = watched[--nwatched];
+        arm();
+    }
+}
+
+int watchdog_active() {
+    return nwatched > 0;
+}
+
+int watchdog_fd() {
+    return nwatched > 0 ? timer : -1;
+}
+
+// Called by the event loop when the timer expires: signals every job
+// whose deadline passed, escalating to SIGKILL on the second deadline
+void watchdog_fire() {
+    double t = now();
+    uint64_t ticks;
+    int i;
+
+    if (read(timer, &ticks, sizeof(ticks)) < 0 && nwatched == 0)
+        return;
+
+    for (i = nwatched - 1; i >= 0; i--) {
+        Job job = watched[i];
+
+        if (job->deadline > t)
+            continue;
+
+        if (!job->timed_out) {
+            // A stopped job is woken up so it can act on the signal
+            kill(-job->pid, job->timeout_sig);
+            kill(-job->pid, SIGCONT);
+            job->timed_out = job->timeout_sig;
+
+            if (job->kill_after > 0 && job->timeout_sig != SIGKILL) {
+                job->deadline = t + job->kill_after;
+                continue;
+            }
+        } else {
+            kill(-job->pid, SIGKILL);
+            job->timed_out = SIGKILL;
+        }
+
+        job->deadline = 0;
+        watched[i] = watched[--nwatched];
+    }
+    arm();
+}
+
+// Seconds until the watchdog next acts on the job, -1 if it never will
+double job_time_left(Job job) {
+    double left;
+
+    if (job->deadline == 0)
+        return -1;
+    left = job->deadline - now();
+    return left > 0 ? left : 0;
+}
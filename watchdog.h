@@ -0,0 +1,17 @@
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+    #include "process_control.h"
+
+    // Grace period between the timeout signal and SIGKILL, unless -k
+    // says otherwise
+    #define DEFAULT_KILL_AFTER 5.0
+
+    void   watch_job(Job, double, int, double);
+    void   unwatch_job(Job);
+    int    watchdog_active();
+    int    watchdog_fd();
+    void   watchdog_fire();
+    double job_time_left(Job);
+
+#endif
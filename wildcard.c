@@ -0,0 +1,572 @@
+#define _GNU_SOURCE
+#include "wildcard.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define OP_LIT   0
+#define OP_ANY   1
+#define OP_STAR  2
+#define OP_CLASS 3
+
+#define DIR_CACHE_BUCKETS 128
+#define DIR_CACHE_MAX     256
+#define DENTS_BUF_SIZE    65536
+
+struct wc_op {
+    int           type;
+    size_t        len;
+    const char    *lit;
+    unsigned char set[32];
+};
+
+// A pattern compiled once per expansion: literal runs are unescaped and
+// bracket expressions turned into bitmaps, so matching a directory entry
+// never re-parses the pattern
+struct wc_pattern {
+    int          n;
+    int          leading_dot;
+    size_t       min_len;
+    struct wc_op *ops;
+};
+
+// A directory listing as returned by getdents64, kept until the
+// directory's mtime changes
+struct dir_list {
+    char            *path;
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    int             racy;
+    int             busy;
+    char            *names;
+    size_t          names_len;
+    size_t          *offs;
+    unsigned char   *types;
+    size_t          count;
+    struct dir_list *next;
+};
+
+struct linux_dirent64 {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct wc_results {
+    char   **v;
+    size_t n;
+    size_t cap;
+};
+
+static struct dir_list *dir_cache[DIR_CACHE_BUCKETS];
+static int dir_cache_count = 0;
+
+static void glob_from(const char *, char **, int, int, struct wc_results *);
+
+// Fills the bitmap for the bracket expression starting just after '['.
+// Returns the pattern bytes consumed including ']', or 0 if malformed
+static size_t compile_class(const char *p, size_t pn, unsigned char *set) {
+    size_t i = 0, first;
+    int neg = 0, c;
+
+    memset(set, 0, 32);
+    if (i < pn && (p[i] == '!' || p[i] == '^')) {
+        neg = 1;
+        i++;
+    }
+
+    for (first = i; i < pn && (i == first || p[i] != ']'); i++) {
+        unsigned char lo = p[i], hi;
+
+        if (lo == '\\' && i + 1 < pn) lo = p[++i];
+        hi = lo;
+        if (i + 2 < pn && p[i + 1] == '-' && p[i + 2] != ']') {
+            hi = p[i + 2];
+            i += 2;
+        }
+        for (c = lo; c <= hi; c++)
+            set[c >> 3] |= 1 << (c & 7);
+    }
+
+    if (i >= pn) return 0;
+    if (neg)
+        for (c = 0; c < 32; c++) set[c] = ~set[c];
+    return i + 1;
+}
+
+Pattern compile_pattern(const char *p, size_t pn) {
+    Pattern pat = (Pattern) malloc(sizeof(struct wc_pattern) +
+                                   pn * sizeof(struct wc_op) + pn);
+    char *text;
+    size_t i = 0, tn = 0, used;
+
+    pat->ops = (struct wc_op *) (pat + 1);
+    text = (char *) (pat->ops + pn);
+    pat->n = 0;
+    pat->min_len = 0;
+    pat->leading_dot = pn > 0 && p[0] == '.';
+
+    while (i < pn) {
+        struct wc_op *op = &pat->ops[pat->n];
+        char c = p[i];
+
+        if (c == '*') {
+            // Consecutive stars are one star
+            if (pat->n == 0 || op[-1].type != OP_STAR)
+                pat->ops[pat->n++].type = OP_STAR;
+            i++;
+            continue;
+        }
+        if (c == '?') {
+            op->type = OP_ANY;
+            pat->n++;
+            pat->min_len++;
+            i++;
+            continue;
+        }
+        if (c == '[' && (used = compile_class(&p[i + 1], pn - i - 1,
+                                              op->set)) > 0) {
+            op->type = OP_CLASS;
+            pat->n++;
+            pat->min_len++;
+            i += used + 1;
+            continue;
+        }
+
+        // Literal byte, appended to the current literal run
+        if (c == '\\' && i + 1 < pn) c = p[++i];
+        if (pat->n == 0 || op[-1].type != OP_LIT) {
+            op->type = OP_LIT;
+            op->lit = &text[tn];
+            op->len = 0;
+            pat->n++;
+        }
+        text[tn++] = c;
+        pat->ops[pat->n - 1].len++;
+        pat->min_len++;
+        i++;
+    }
+    return pat;
+}
+
+void free_pattern(Pattern pat) {
+    free(pat);
+}
+
+int match_compiled(Pattern pat, const char *str, size_t sn) {
+    int oi = 0, star_o = -1;
+    size_t si = 0, star_s = 0;
+    const struct wc_op *last = pat->n ? &pat->ops[pat->n - 1] : NULL;
+
+    // Cheap rejections: too short, or a trailing literal such as ".log"
+    // that does not match the end of the name
+    if (sn < pat->min_len)
+        return 0;
+    if (last && last->type == OP_LIT &&
+        memcmp(&str[sn - last->len], last->lit, last->len))
+        return 0;
+
+    while (oi < pat->n || si < sn) {
+        if (oi < pat->n) {
+            const struct wc_op *op = &pat->ops[oi];
+
+            switch (op->type) {
+                case OP_STAR:
+                    star_o = ++oi;
+                    star_s = si;
+                    continue;
+                case OP_ANY:
+                    if (si < sn) {
+                        oi++;
+                        si++;
+                        continue;
+                    }
+                    break;
+                case OP_CLASS:
+                    if (si < sn && (op->set[(unsigned char) str[si] >> 3] &
+                                    1 << (str[si] & 7))) {
+                        oi++;
+                        si++;
+                        continue;
+                    }
+                    break;
+                case OP_LIT:
+                    if (sn - si >= op->len &&
+                        !memcmp(&str[si], op->lit, op->len)) {
+                        oi++;
+                        si += op->len;
+                        continue;
+                    }
+                    break;
+            }
+        }
+        if (star_o < 0 || star_s >= sn)
+            return 0;
+        oi = star_o;
+        si = ++star_s;
+    }
+    return 1;
+}
+
+// Whether the pattern has a '*', '?' or '[' that is not escaped
+int has_wildcards(const char *word) {
+    for (; *word; word++) {
+        if (*word == '\\' && word[1])
+            word++;
+        else if (*word == '*' || *word == '?' || *word == '[')
+            return 1;
+    }
+    return 0;
+}
+
+// Copy of a component without wildcards, its escapes removed
+static char *unescape(const char *comp) {
+    char *copy = (char *) malloc(strlen(comp) + 1), *w = copy;
+
+    for (; *comp; comp++) {
+        if (*comp == '\\' && comp[1])
+            comp++;
+        *w++ = *comp;
+    }
+    *w = 0;
+    return copy;
+}
+
+static unsigned hash_path(const char *path) {
+    unsigned h = 2166136261u;
+
+    for (; *path; path++) h = (h ^ (unsigned char) *path) * 16777619u;
+    return h % DIR_CACHE_BUCKETS;
+}
+
+static void free_dir_list(struct dir_list *list) {
+    free(list->path);
+    free(list->names);
+    free(list->offs);
+    free(list->types);
+    free(list);
+}
+
+void flush_dir_cache() {
+    int i;
+
+    for (i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        while (dir_cache[i]) {
+            struct dir_list *next = dir_cache[i]->next;
+
+            free_dir_list(dir_cache[i]);
+            dir_cache[i] = next;
+        }
+    }
+    dir_cache_count = 0;
+}
+
+// Reads a whole directory with getdents64 into one names buffer
+static struct dir_list *read_dir(const char *path, struct stat *st) {
+    struct dir_list *list;
+    struct timespec now;
+    char *buf;
+    long n, pos;
+    size_t cap = 64, names_cap = DENTS_BUF_SIZE;
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    list = (struct dir_list *) calloc(1, sizeof(struct dir_list));
+    list->path = strdup(path);
+    list->dev = st->st_dev;
+    list->ino = st->st_ino;
+    list->mtime = st->st_mtim;
+    list->offs = (size_t *) malloc(cap * sizeof(size_t));
+    list->types = (unsigned char *) malloc(cap);
+    list->names = (char *) malloc(names_cap);
+    buf = (char *) malloc(DENTS_BUF_SIZE);
+
+    while ((n = syscall(SYS_getdents64, fd, buf, DENTS_BUF_SIZE)) > 0) {
+        for (pos = 0; pos < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) &buf[pos];
+            size_t len = strlen(d->d_name) + 1;
+
+            pos += d->d_reclen;
+            if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+                continue;
+
+            if (list->count == cap) {
+                cap *= 2;
+                list->offs = (size_t *) realloc(list->offs,
+                                                cap * sizeof(size_t));
+                list->types = (unsigned char *) realloc(list->types, cap);
+            }
+            if (list->names_len + len > names_cap) {
+                names_cap *= 2;
+                list->names = (char *) realloc(list->names, names_cap);
+            }
+
+            memcpy(&list->names[list->names_len], d->d_name, len);
+            list->offs[list->count] = list->names_len;
+            list->types[list->count] = d->d_type;
+            list->names_len += len;
+            list->count++;
+        }
+    }
+    free(buf);
+    close(fd);
+
+    // An mtime within a second of the read may hide a later change made
+    // in the same timestamp tick, such listings are never trusted again
+    clock_gettime(CLOCK_REALTIME, &now);
+    list->racy = list->mtime.tv_sec >= now.tv_sec - 1;
+    return list;
+}
+
+// Returns the listing of a directory, from the cache when the directory
+// is unchanged since it was read
+static struct dir_list *get_dir(const char *path) {
+    struct dir_list **slot = &dir_cache[hash_path(path)], *list;
+    struct stat st;
+
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (list = *slot; list; list = list->next) {
+        if (strcmp(list->path, path))
+            continue;
+        if (list->busy ||
+            (!list->racy && list->dev == st.st_dev &&
+             list->ino == st.st_ino &&
+             list->mtime.tv_sec == st.st_mtim.tv_sec &&
+             list->mtime.tv_nsec == st.st_mtim.tv_nsec))
+            return list;
+        break;
+    }
+
+    // Stale or missing, read it again and replace the old listing
+    if (list) {
+        struct dir_list **p = slot;
+
+        while (*p != list) p = &(*p)->next;
+        *p = list->next;
+        free_dir_list(list);
+        dir_cache_count--;
+    }
+
+    if (!(list = read_dir(path, &st)))
+        return NULL;
+    list->next = *slot;
+    *slot = list;
+    dir_cache_count++;
+    return list;
+}
+
+static void add_result(struct wc_results *r, char *path) {
+    if (r->n == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 16;
+        r->v = (char **) realloc(r->v, r->cap * sizeof(char *));
+    }
+    r->v[r->n++] = path;
+}
+
+static char *join_path(const char *base, const char *name, int slash) {
+    size_t bn = strlen(base), nn = strlen(name);
+    char *path = (char *) malloc(bn + nn + 2);
+
+    memcpy(path, base, bn);
+    memcpy(&path[bn], name, nn);
+    if (slash) path[bn + nn++] = '/';
+    path[bn + nn] = 0;
+    return path;
+}
+
+static int is_dir_entry(const char *path, unsigned char type, int follow) {
+    struct stat st;
+
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) return 0;
+    if ((follow ? stat(path, &st) : lstat(path, &st)) == -1) return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+// "**": zero or more directories. Symbolic links are not followed, so a
+// link cycle cannot make the walk endless
+static void glob_star(const char *base, char **comps, int ncomps, int flags,
+                      struct wc_results *r) {
+    struct dir_list *list;
+    size_t i;
+
+    if (ncomps > 1)
+        glob_from(base, comps + 1, ncomps - 1, flags, r);
+
+    if (!(list = get_dir(base[0] ? base : ".")))
+        return;
+
+    list->busy++;
+    for (i = 0; i < list->count; i++) {
+        const char *name = &list->names[list->offs[i]];
+        char *path;
+
+        if (name[0] == '.')
+            continue;
+
+        path = join_path(base, name, 0);
+        if (ncomps == 1)
+            add_result(r, strdup(path));
+        if (is_dir_entry(path, list->types[i], 0)) {
+            char *dir = join_path(base, name, 1);
+
+            glob_star(dir, comps, ncomps, flags, r);
+            free(dir);
+        }
+        free(path);
+    }
+    list->busy--;
+}
+
+// Matches comps[0] against the entries of base (empty or '/' terminated)
+// and descends for the remaining components
+static void glob_from(const char *base, char **comps, int ncomps, int flags,
+                      struct wc_results *r) {
+    const char *comp = comps[0];
+    struct dir_list *list;
+    struct stat st;
+    Pattern pat;
+    size_t i;
+
+    if (!has_wildcards(comp)) {
+        char *name = unescape(comp);
+        char *path = join_path(base, name, ncomps > 1);
+
+        free(name);
+
+        if (ncomps > 1)
+            glob_from(path, comps + 1, ncomps - 1, flags, r);
+        else if (lstat(path, &st) == 0) {
+            add_result(r, path);
+            return;
+        }
+        free(path);
+        return;
+    }
+
+    if ((flags & WC_GLOBSTAR) && !strcmp(comp, "**")) {
+        glob_star(base, comps, ncomps, flags, r);
+        return;
+    }
+
+    if (!(list = get_dir(base[0] ? base : ".")))
+        return;
+
+    pat = compile_pattern(comp, strlen(comp));
+    list->busy++;
+    for (i = 0; i < list->count; i++) {
+        const char *name = &list->names[list->offs[i]];
+        char *path;
+
+        // Hidden entries only match a pattern starting with '.'
+        if (name[0] == '.' && !pat->leading_dot)
+            continue;
+        if (!match_compiled(pat, name, strlen(name)))
+            continue;
+
+        if (ncomps == 1) {
+            add_result(r, join_path(base, name, 0));
+            continue;
+        }
+        path = join_path(base, name, 0);
+        if (is_dir_entry(path, list->types[i], 1)) {
+            char *dir = join_path(base, name, 1);
+
+            glob_from(dir, comps + 1, ncomps - 1, flags, r);
+            free(dir);
+        }
+        free(path);
+    }
+    list->busy--;
+    free_pattern(pat);
+}
+
+static void swap_strings(char **v, size_t i, size_t j) {
+    char *t = v[i];
+
+    v[i] = v[j];
+    v[j] = t;
+}
+
+// Multikey quicksort on raw bytes: locale independent, and each byte of
+// a shared prefix is compared once per partition rather than once per
+// comparison as with qsort + strcmp
+static void mkqsort(char **v, size_t n, size_t depth) {
+    while (n > 1) {
+        size_t lt = 0, i = 1, gt = n;
+        int pivot, c;
+
+        if (n < 16) {
+            size_t j;
+
+            for (i = 1; i < n; i++)
+                for (j = i; j > 0 && strcmp(v[j - 1] + depth,
+                                            v[j] + depth) > 0; j--)
+                    swap_strings(v, j - 1, j);
+            return;
+        }
+
+        swap_strings(v, 0, n / 2);
+        pivot = (unsigned char) v[0][depth];
+
+        // [0, lt) < pivot, [lt, i) == pivot, [gt, n) > pivot
+        while (i < gt) {
+            c = (unsigned char) v[i][depth];
+            if (c < pivot) swap_strings(v, lt++, i++);
+            else if (c > pivot) swap_strings(v, i, --gt);
+            else i++;
+        }
+
+        mkqsort(v, lt, depth);
+        if (pivot != 0)
+            mkqsort(&v[lt], gt - lt, depth + 1);
+        v += gt;
+        n -= gt;
+    }
+}
+
+void sort_strings(char **v, size_t n) {
+    mkqsort(v, n, 0);
+}
+
+// Pathname expansion of a word. Returns the number of matches, stored
+// sorted in *matches, or 0 when nothing matched
+int expand_wildcards(const char *word, int flags, char ***matches) {
+    struct wc_results r = { NULL, 0, 0 };
+    char *copy = strdup(word), *rest = copy, **comps, *comp;
+    int ncomps = 0;
+
+    // Never evict while a walk may hold a listing
+    if (dir_cache_count > DIR_CACHE_MAX)
+        flush_dir_cache();
+
+    comps = (char **) malloc((strlen(word) + 1) * sizeof(char *));
+    while ((comp = strsep(&rest, "/")) != NULL) {
+        // Skip empty components, but keep a trailing one so "*/" only
+        // matches directories
+        if (comp[0] || !rest)
+            comps[ncomps++] = comp;
+    }
+
+    glob_from(word[0] == '/' ? "/" : "", comps, ncomps, flags, &r);
+    free(comps);
+    free(copy);
+
+    sort_strings(r.v, r.n);
+    *matches = r.v;
+    return (int) r.n;
+}
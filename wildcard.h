@@ -0,0 +1,20 @@
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+    #include <stddef.h>
+
+    // Expansion flags
+    #define WC_GLOBSTAR 0x1
+
+    typedef struct wc_pattern *Pattern;
+
+    Pattern compile_pattern(const char *, size_t);
+    int     match_compiled(Pattern, const char *, size_t);
+    void    free_pattern(Pattern);
+
+    int  has_wildcards(const char *);
+    int  expand_wildcards(const char *, int, char ***);
+    void sort_strings(char **, size_t);
+    void flush_dir_cache();
+
+#endif